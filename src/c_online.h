@@ -1,5 +1,6 @@
 #include "core.h"
 
+#if FEATURE_ONLINE
 const String base_url = "";
 
 uint32_t update_time = 0;
@@ -11,7 +12,7 @@ bool block_get_online_data = false;
 
 void activationOnlineMode();
 void deactivationOnlineMode();
-void manualUpdate();
+void manualUpdate(AsyncWebServerRequest *request);
 void checkForUpdate();
 void getTime();
 void putOnlineData(String data);
@@ -24,7 +25,7 @@ void readOnlineData(String payload);
 
 void activationOnlineMode() {}
 void deactivationOnlineMode() {}
-void manualUpdate() {}
+void manualUpdate(AsyncWebServerRequest *request) {}
 void checkForUpdate() {}
 void getTime() {}
 void putOnlineData(String data) {}
@@ -33,3 +34,4 @@ void putOnlineData(String data, bool logs, bool flawless) {}
 void putOnlineData(String variant, String data, bool logs, bool flawless) {}
 void getOnlineData() {}
 void readOnlineData(String payload) {}
+#endif
@@ -1,36 +1,263 @@
+// Build profiles, PROFILE_LOCAL keeps only the buttons, the smart settings and the peer sync.
+// Each feature can also be left out on its own with -D FEATURE_...=0, leaving no code, globals or routes behind.
+#ifdef PROFILE_LOCAL
+#define PROFILE_NAME "local"
+#define FEATURE_ONLINE 0
+#define FEATURE_LOG 0
+#define FEATURE_OTA 0
+#define FEATURE_GEO 0
+#endif
+
+#ifndef PROFILE_NAME
+#define PROFILE_NAME "full"
+#endif
+#ifndef FEATURE_ONLINE
+#define FEATURE_ONLINE 1
+#endif
+#ifndef FEATURE_LOG
+#define FEATURE_LOG 1
+#endif
+#ifndef FEATURE_OTA
+#define FEATURE_OTA 1
+#endif
+#ifndef FEATURE_GEO
+#define FEATURE_GEO 1
+#endif
+
 #include <Wire.h>
 #include <SPI.h>
 #include <LittleFS.h>
+#include <EEPROM.h>
 #include <RTClib.h>
 #include <ESP8266WiFi.h>
-#include <ESP8266WebServer.h>
+#include <ESPAsyncTCP.h>
+#include <ESPAsyncWebServer.h>
 #include <ESP8266HTTPClient.h>
 #include <ESP8266mDNS.h>
 #include <ArduinoJson.h>
+#if FEATURE_OTA
 #include <ArduinoOTA.h>
+#endif
+#include <coredecls.h>
+#include <Ticker.h>
 #include "main.h"
 
+#define LEVEL_ERROR 1
+#define LEVEL_INFO 2
+#define LEVEL_DEBUG 3
+
+// Messages above LOG_LEVEL are removed at compile time, messages above log_level are not even formatted.
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LEVEL_INFO
+#endif
+
+#define NOTE(level, text) do { if (level <= LOG_LEVEL && isNoted(level)) { note(text); } } while (0)
+#define NOTE_ERROR(text) NOTE(LEVEL_ERROR, text)
+#define NOTE_INFO(text) NOTE(LEVEL_INFO, text)
+#define NOTE_DEBUG(text) NOTE(LEVEL_DEBUG, text)
+
+#define TASK_SAVE_SETTINGS 1
+#define TASK_SUN_CHECK 2
+#define TASK_SAVE_UPRISINGS 3
+#define TASK_SIMULATION 4
+#define TASK_READ_DATA 5
+
+#define BOOT_RELAYS 0
+#define BOOT_FILESYSTEM 1
+#define BOOT_SETTINGS 2
+#define BOOT_OTA 3
+#define BOOT_WIFI 4
+#define BOOT_SERVICES 5
+
+#define SECTION_LOOP 0
+#define SECTION_SUN 1
+#define SECTION_MDNS 2
+#define SECTION_LOGS 3
+#define SECTION_WPS 4
+#define SECTION_SYNC 5
+#define SECTION_SETTINGS 6
+
+// Marks how far the innermost section got, the line is reported with a stall or a postmortem.
+#define PROGRESS() markProgress(__LINE__)
+
+// RTC_Millis keeps the millis() of the last full second, the relay timer needs it to hit the exact minute.
+class Clock : public RTC_Millis {
+public:
+  uint32_t secondMillis() {
+    now();
+    return lastMillis;
+  }
+
+  uint32_t millisAt(uint32_t time) {
+    DateTime current = now();
+    return lastMillis + (time - current.unixtime()) * 1000;
+  }
+};
+
 // RTC_DS1307 RTC;
-RTC_Millis RTC;
+Clock RTC;
 
-ESP8266WebServer server(80);
+AsyncWebServer server(80);
 HTTPClient HTTP;
 WiFiClient WIFI;
 
 // core version = 18;
 bool offline = true;
+#if FEATURE_LOG
 bool keep_log = false;
 
-const char days_of_the_week[7][2] = {"s", "o", "u", "e", "h", "r", "a"};
+struct LogIndex {
+  uint32_t time;
+  uint32_t offset;
+};
+
+// Every log_block bytes of /log.txt get a record in /log.idx, a range query reads only the blocks it needs.
+// A clock set back starts a new record at once, so the time only grows within a block, though not across them.
+const uint32_t log_block = 1024;
+int32_t log_indexed = -1;
+uint32_t log_indexed_time = 0;
+#endif
+// Serial output is on unless /noserial.txt exists, without it the messages are not even formatted when the log is off.
+bool serial_log = true;
+int log_level = LOG_LEVEL;
+
+char serial_buffer[512];
+int serial_head = 0;
+int serial_tail = 0;
+uint32_t serial_dropped = 0;
+
+const char days_of_the_week[7][2] PROGMEM = {"s", "o", "u", "e", "h", "r", "a"};
 char host_name[30] = {0};
 String devices = "";
+bool static_devices = false;
+const int devices_limit = 8;
+
+// mDNS queries block for about a second, so the peers found are reused for discovery_interval or until one fails.
+uint32_t last_discovery = 0;
+const uint32_t discovery_interval = 300000;
+
+// Traffic counters reported by /stats.
+uint32_t messages_sent = 0;
+uint32_t messages_failed = 0;
+uint32_t messages_received = 0;
+uint32_t discoveries = 0;
+uint64_t handler_time = 0;
+uint32_t request_errors = 0;
+
+// Bumped on every change visible in /hello or /state and sent as the ETag, the epoch tells boots apart.
+uint32_t state_version = 0;
+uint32_t state_epoch = 0;
+uint32_t not_modified = 0;
+
+struct Bucket {
+  uint32_t ip;
+  int32_t tokens;
+  uint32_t refill;
+};
+
+// Token buckets in thousandths of a request, one per recent client and one shared by all parsing requests.
+Bucket client_buckets[8] = {};
+Bucket global_bucket = {0, 20000, 0};
+const int client_rate = 5;
+const int client_burst = 10;
+const int global_rate = 10;
+const int global_burst = 20;
+uint32_t requests_throttled = 0;
+uint32_t requests_overloaded = 0;
+
+// Four buckets per power of two of microseconds up to 2^26, percentiles are reported as the upper bound of a bucket (at most 25 % above the value).
+// A full bucket halves all of them, so the percentiles follow the recent samples while count stays the total.
+const int histogram_buckets = 100;
+
+struct Histogram {
+  uint16_t buckets[histogram_buckets];
+  uint32_t count;
+  uint32_t max;
+};
+
+Histogram hello_latency = {};
+Histogram set_latency = {};
+Histogram state_latency = {};
+Histogram loop_latency = {};
+
+struct Hop {
+  uint16_t id;
+  uint32_t ip;
+  uint32_t latency;
+};
+
+// A button press starts a trace, its id and origin time in milliseconds of the UTC day travel with the update.
+// Receivers measure the hop against their own clock, so the result includes the clock skew between the devices.
+uint16_t trace_id = 0;
+uint32_t trace_origin = 0;
+uint32_t trace_start = 0;
+uint32_t data_source = 0;
+Histogram press_latency = {};
+Histogram send_latency = {};
+Histogram hop_latency = {};
+Histogram relay_jitter = {};
+Hop recent_hops[4] = {};
+int hop_head = 0;
 
 String ssid = "";
 String password = "";
 
+// Access point and lease of the last connection, used to associate without scanning and DHCP.
+uint8_t wifi_bssid[6] = {0};
+int wifi_channel = 0;
+uint32_t wifi_ip = 0;
+uint32_t wifi_gateway = 0;
+uint32_t wifi_subnet = 0;
+uint32_t wifi_dns = 0;
+uint32_t wifi_connect_time = 0;
+
+// The cached address is only reused for wifi_lease_boots boots and wifi_lease_time of uptime, then DHCP renews it.
+// The router may hand an unrenewed lease to another device, which Wi-Fi itself never reports.
+const int wifi_lease_boots = 10;
+const uint32_t wifi_lease_time = 43200000;
+int wifi_lease_boot = 0;
+uint32_t wifi_static_since = 0;
+bool wifi_renewing = false;
+
 uint32_t start_time = 0;
 uint32_t loop_time = 0;
+uint32_t tick_millis = 0;
 int uprisings = 1;
+
+// Boots not yet written to /uprisings.bin are counted in the RTC user memory, which survives everything but a power cut.
+// The file is only written once a boot has lasted uprisings_delay, so a reset loop does not wear the flash.
+const uint32_t uprisings_magic = 0x55505253;
+const uint32_t uprisings_block = 64;
+const uint32_t uprisings_delay = 60000;
+bool uprisings_saved = false;
+const char boot_phase_names[6][9] PROGMEM = {"relays", "fs", "settings", "ota", "wifi", "services"};
+uint32_t boot_phases[6] = {0};
+
+struct Watchdog {
+  uint32_t magic;
+  uint32_t time;
+  uint32_t depth;
+  uint8_t sections[4];
+  uint32_t callers[4];
+  uint16_t lines[4];
+};
+
+// The stack of sections being executed is mirrored in the RTC user memory, which survives a watchdog reset.
+// A section that runs longer than stall_threshold is reported as a stall by stall_ticker while it still runs,
+// the ticker only fires when the section yields, one that never does ends in a watchdog reset and the postmortem.
+const char section_names[7][9] PROGMEM = {"loop", "sun", "mdns", "logs", "wps", "sync", "settings"};
+const uint32_t watchdog_magic = 0x57444f48;
+const uint32_t watchdog_block = 32;
+const uint32_t stall_threshold = 1000;
+const uint32_t stall_check = 250;
+Watchdog watchdog = {watchdog_magic, 0, 0, {0}, {0}, {0}};
+Ticker stall_ticker;
+uint32_t section_start[4] = {0};
+bool section_stalled[4] = {false};
+uint32_t last_stall_at = 0;
+uint32_t stalls = 0;
+String last_stall = "";
+String postmortem = "";
 int offset = 0;
 bool dst = false;
 
@@ -47,27 +274,255 @@ bool also_sensors = false;
 int dusk_delay = 0;
 int dawn_delay = 0;
 
+// Slow side effects of the HTTP handlers, carried out by loop() after the reply has been sent.
+byte tasks[8];
+int task_head = 0;
+int task_count = 0;
+uint32_t tasks_dropped = 0;
+#ifdef SIMULATOR
+// Set while the simulator runs the rules on its virtual clock, the tasks they defer are ignored.
+// It is cleared whenever the simulator yields, so the tasks of the handlers are queued as usual.
+bool tasks_muted = false;
+#endif
+
+// Data received by the handlers, the server runs outside of loop() so readData() applies it from there.
+String received_data[4];
+uint32_t received_source[4];
+int received_head = 0;
+int received_count = 0;
+
+struct SyncReply {
+  String ip;
+  String request;
+  String data;
+  AsyncClient* client = NULL;
+  bool done = false;
+  bool parsed = false;
+  bool valid = false;
+  int offset = 0;
+  bool dst = false;
+  uint32_t time = 0;
+  uint32_t sequence = 0;
+  uint32_t epoch = 0;
+  String zone;
+};
+
+// At boot the peers are asked in parallel, the first answer confirmed by sync_quorum of them wins.
+const int sync_quorum = 2;
+const uint32_t sync_timeout = 3000;
+
+struct Stamp {
+  uint32_t lamport;
+  uint32_t sequence;
+};
+
+struct SyncCursor {
+  uint32_t ip;
+  uint32_t sequence;
+  uint32_t epoch;
+};
+
+// Fields shared with the peers keep a Lamport stamp to settle conflicts and the local sequence of their last change.
+// The low byte of a Lamport stamp is the low byte of the chip id, devices can share it, so equal stamps are settled by the value.
+// Only local edits create stamps, a field without a stamp in a sync reply is older than any stamped one.
+// Peers remember the last sequence they have seen from each device and only ask for newer changes.
+// The sequence is only saved with the settings and may go back after a reboot, so a cursor holds the state_epoch
+// of the boot it came from and one from another boot gets the full state.
+// The clock and twilight are not saved, their stamps start over with them at boot.
+uint32_t sync_clock = 0;
+uint32_t sync_sequence = 0;
+Stamp offset_stamp = {};
+Stamp dst_stamp = {};
+Stamp time_stamp = {};
+Stamp twilight_stamp = {};
+SyncCursor sync_cursors[8] = {};
+
+// Cloud notifications waiting for the coalescing window, only the latest value of each key is sent.
+const char outbound_keys[3][7] PROGMEM = {"val", "smart", "detail"};
+String outbound[3];
+String outbound_trace = "";
+uint32_t outbound_since = 0;
+int outbound_window = 500;
+const int outbound_window_limit = 10000;
+uint32_t outbound_merged = 0;
+
+#if FEATURE_ONLINE
+// Cloud notifications made without Wi-Fi, appended as key=value lines and replayed once the connection is back.
+// Only the last line of each key counts, the file is rewritten with just those when it grows past outbox_limit.
+const size_t outbox_limit = 2048;
+const uint32_t outbox_retry_interval = 10000;
+bool outbox_pending = false;
+uint32_t outbox_retry = 0;
+uint32_t outbox_stored = 0;
+uint32_t outbox_replayed = 0;
+#endif
+
+// Larger bodies are rejected, the settings never exceed the 1 KB JSON document anyway.
+const size_t body_limit = 1024;
+
+// The JSON documents of the handlers are stacked in a static arena, apart from the heap holding the long-lived state.
+// Every block starts with the offset of the block below it, freeing the top block moves the top back to that one.
+// Handlers of the async server can interleave, a block freed out of order stays in place until the arena is empty and is counted in arena_leaks.
+// A document that does not fit comes from the heap and is counted in arena_overflows.
+uint8_t arena[1536] __attribute__((aligned(4)));
+size_t arena_used = 0;
+size_t arena_top = 0;
+int arena_blocks = 0;
+size_t arena_peak = 0;
+uint32_t arena_overflows = 0;
+uint32_t arena_leaks = 0;
+
+struct ArenaAllocator {
+  void* allocate(size_t size) {
+    size = (size + 3) & ~3;
+    if (arena_used + size + 4 > sizeof(arena)) {
+      arena_overflows++;
+      return malloc(size);
+    }
+
+    uint32_t* header = (uint32_t*)(arena + arena_used);
+    *header = arena_top;
+    arena_top = arena_used;
+    arena_used += size + 4;
+    arena_blocks++;
+    arena_peak = max(arena_peak, arena_used);
+    return header + 1;
+  }
+
+  void deallocate(void* pointer) {
+    if (pointer < arena || pointer >= arena + sizeof(arena)) {
+      free(pointer);
+      return;
+    }
+
+    size_t start = (uint8_t*)pointer - arena - 4;
+    arena_blocks--;
+    if (arena_blocks == 0) {
+      arena_used = 0;
+      arena_top = 0;
+    } else if (start == arena_top) {
+      arena_used = start;
+      arena_top = *(uint32_t*)(arena + start);
+    } else {
+      arena_leaks++;
+    }
+  }
+
+  void* reallocate(void* pointer, size_t size) {
+    if (pointer < arena || pointer >= arena + sizeof(arena)) {
+      return realloc(pointer, size);
+    }
+
+    size_t start = (uint8_t*)pointer - arena - 4;
+    if (start == arena_top && start + 4 + size <= sizeof(arena)) {
+      arena_used = start + 4 + ((size + 3) & ~3);
+      arena_peak = max(arena_peak, arena_used);
+      return pointer;
+    }
+
+    void* moved = malloc(size);
+    if (moved) {
+      memcpy(moved, pointer, min(size, (start == arena_top ? arena_used : sizeof(arena)) - start - 4));
+      deallocate(pointer);
+      arena_overflows++;
+    }
+    return moved;
+  }
+};
+
+typedef BasicJsonDocument<ArenaAllocator> ArenaJsonDocument;
+
 bool strContains(String text, String value);
 bool strContains(int text, String value);
 bool RTCisrunning();
 bool hasTimeChanged();
+void markBootPhase(int phase);
+String getBootPhases();
+bool isNoted(int level);
+void printSerial(String text);
+void flushSerial();
+void activationSerialLog(AsyncWebServerRequest *request);
+void deactivationSerialLog(AsyncWebServerRequest *request);
 void note(String text);
-bool writeObjectToFile(String name, DynamicJsonDocument object);
 String get1(String text, int index);
 String getSmartString();
+char getDayOfTheWeek(int day);
+void addToHistogram(Histogram& histogram, uint32_t value);
+int getBucket(uint32_t value);
+uint32_t getBucketLimit(int bucket);
+uint32_t getPercentile(Histogram& histogram, int permille);
+String getHistogram(Histogram& histogram);
+uint32_t getDayMillis();
+void startTrace();
+String getTrace();
+void recordHop(String trace);
+String getRecentHops();
+bool deferTask(byte type);
+bool queueData(AsyncWebServerRequest *request);
+void readReceivedData();
+void queueOutbound(String data);
+String takeOutbound(bool force);
+#if FEATURE_ONLINE
+void storeOutbox(String data);
+String readOutbox();
+#endif
 void connectingToWifi();
+bool waitForWifi(int timeout);
+void cacheWifi();
+void renewLease();
 void initiatingWPS();
-void activationTheLog();
-void deactivationTheLog();
-void requestForLogs();
-void clearTheLog();
+void receiveBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total);
+bool hasBody(AsyncWebServerRequest *request);
+bool isBodyTooLarge(AsyncWebServerRequest *request);
+bool isValidData(String payload);
+bool takeToken(Bucket& bucket, int rate, int burst);
+bool admitRequest(AsyncWebServerRequest *request);
+String getETag();
+bool isNotModified(AsyncWebServerRequest *request);
+void sendWithETag(AsyncWebServerRequest *request, String reply);
+String getBody(AsyncWebServerRequest *request);
+#if FEATURE_LOG
+void activationTheLog(AsyncWebServerRequest *request);
+void deactivationTheLog(AsyncWebServerRequest *request);
+void requestForLogs(AsyncWebServerRequest *request);
+void clearTheLog(AsyncWebServerRequest *request);
+void indexTheLog(uint32_t position);
+bool findLogRange(uint32_t from, uint32_t to, uint32_t& start, uint32_t& end);
+#endif
+#if FEATURE_GEO
 void getSunriseSunset(int day);
+#endif
 int findMDNSDevices();
-void receivedOfflineData();
+int countDevices();
+bool isDeviceList(String list);
+void receivedOfflineData(AsyncWebServerRequest *request);
 void putOfflineData(String url, String data);
 void putMultiOfflineData(String data);
 void getOfflineData();
+bool takeStamp(Stamp& stamp, uint32_t remote, bool peer, bool tie);
+bool isChanged(Stamp& stamp, uint32_t since);
+SyncCursor& getCursor(uint32_t ip);
+void parseSyncReply(SyncReply& reply);
+#if FEATURE_OTA
 void setupOTA();
+#endif
+void enterSection(int section, void* caller);
+void leaveSection();
+void markProgress(int line);
+String getSectionName(Watchdog& record, int i);
+void recordStall(int i, uint32_t duration, bool count);
+void checkStalls();
+void readPostmortem();
+
+struct Section {
+  Section(int section) {
+    enterSection(section, __builtin_return_address(0));
+  }
+
+  ~Section() {
+    leaveSection();
+  }
+};
 
 
 bool strContains(String text, String value) {
@@ -87,11 +542,177 @@ bool hasTimeChanged() {
   uint32_t current_time = RTCisrunning() ? RTC.now().unixtime() : millis() / 1000;
   if (abs(current_time - loop_time) >= 1) {
     loop_time = current_time;
+    tick_millis = millis();
     return true;
   }
   return false;
 }
 
+void markBootPhase(int phase) {
+  if (boot_phases[phase] == 0) {
+    boot_phases[phase] = millis();
+  }
+}
+
+String getBootPhases() {
+  String result = "";
+  for (int i = 0; i < 6; i++) {
+    result += String(i > 0 ? "," : "") + "\"" + FPSTR(boot_phase_names[i]) + "\":" + boot_phases[i];
+  }
+  return "{" + result + "}";
+}
+
+void enterSection(int section, void* caller) {
+  if (watchdog.depth < 4) {
+    watchdog.sections[watchdog.depth] = section;
+    watchdog.callers[watchdog.depth] = (uint32_t)(uintptr_t)caller;
+    watchdog.lines[watchdog.depth] = 0;
+    section_start[watchdog.depth] = millis();
+    section_stalled[watchdog.depth] = false;
+  }
+  watchdog.depth++;
+  watchdog.time = RTCisrunning() ? RTC.now().unixtime() - offset - (dst ? 3600 : 0) : millis() / 1000;
+  ESP.rtcUserMemoryWrite(watchdog_block, (uint32_t*)&watchdog, sizeof(watchdog));
+}
+
+void leaveSection() {
+  if (watchdog.depth == 0) {
+    return;
+  }
+  watchdog.depth--;
+  ESP.rtcUserMemoryWrite(watchdog_block, (uint32_t*)&watchdog, sizeof(watchdog));
+
+  int i = watchdog.depth;
+  if (i >= 4) {
+    return;
+  }
+
+  uint32_t duration = millis() - section_start[i];
+  if (duration > stall_threshold && (section_stalled[i] || (int32_t)(section_start[i] - last_stall_at) >= 0)) {
+    recordStall(i, duration, !section_stalled[i]);
+    NOTE_ERROR(String(F("Stall in ")) + last_stall);
+  }
+  section_stalled[i] = false;
+}
+
+void markProgress(int line) {
+  if (watchdog.depth == 0 || watchdog.depth > 4) {
+    return;
+  }
+  watchdog.lines[watchdog.depth - 1] = line;
+  ESP.rtcUserMemoryWrite(watchdog_block, (uint32_t*)&watchdog, sizeof(watchdog));
+}
+
+String getSectionName(Watchdog& record, int i) {
+  return String(FPSTR(section_names[record.sections[i]])) + "@0x" + String(record.callers[i], HEX) + "#" + String(record.lines[i]);
+}
+
+void recordStall(int i, uint32_t duration, bool count) {
+  if (count) {
+    stalls++;
+  }
+  state_version++;
+  last_stall_at = millis();
+  last_stall = getSectionName(watchdog, i) + ":" + String(duration);
+}
+
+void checkStalls() {
+  // Runs from the ticker, the note is left to leaveSection() as the log can't be written from here.
+  for (int i = (int)min(watchdog.depth, (uint32_t)4) - 1; i >= 0; i--) {
+    uint32_t duration = millis() - section_start[i];
+    if (!section_stalled[i] && duration > stall_threshold && (int32_t)(section_start[i] - last_stall_at) >= 0) {
+      section_stalled[i] = true;
+      recordStall(i, duration, true);
+    }
+  }
+}
+
+void readPostmortem() {
+  Watchdog record;
+  int reason = ESP.getResetInfoPtr()->reason;
+
+  if (ESP.rtcUserMemoryRead(watchdog_block, (uint32_t*)&record, sizeof(record)) && record.magic == watchdog_magic && record.depth > 0
+  && (reason == REASON_WDT_RST || reason == REASON_EXCEPTION_RST || reason == REASON_SOFT_WDT_RST)) {
+    for (uint32_t i = 0; i < min(record.depth, (uint32_t)4) && record.sections[i] < 7; i++) {
+      postmortem += String(i > 0 ? ">" : "") + getSectionName(record, i);
+    }
+    postmortem += String(F(" at ")) + String(record.time) + F(", ") + ESP.getResetReason();
+    if (reason == REASON_EXCEPTION_RST || reason == REASON_SOFT_WDT_RST) {
+      rst_info* info = ESP.getResetInfoPtr();
+      postmortem += String(F(" 0x")) + String(info->epc1, HEX) + F(" 0x") + String(info->epc2, HEX) + F(" 0x") + String(info->epc3, HEX);
+    }
+    NOTE_ERROR(String(F("Postmortem: ")) + postmortem);
+    state_version++;
+  }
+
+  ESP.rtcUserMemoryWrite(watchdog_block, (uint32_t*)&watchdog, sizeof(watchdog));
+  stall_ticker.attach_ms(stall_check, checkStalls);
+}
+
+bool isNoted(int level) {
+#if FEATURE_LOG
+  return level <= log_level && (keep_log || serial_log);
+#else
+  return level <= log_level && serial_log;
+#endif
+}
+
+void printSerial(String text) {
+  if (!serial_log) {
+    return;
+  }
+
+  // A message that does not fit is dropped as a whole, a cut one would run into the next.
+  int used = (serial_head - serial_tail + sizeof(serial_buffer)) % sizeof(serial_buffer);
+  if (text.length() >= sizeof(serial_buffer) - used) {
+    serial_dropped++;
+    flushSerial();
+    return;
+  }
+
+  for (char c: text) {
+    serial_buffer[serial_head] = c;
+    serial_head = (serial_head + 1) % sizeof(serial_buffer);
+  }
+  flushSerial();
+}
+
+void flushSerial() {
+  int space = Serial.availableForWrite();
+  while (space-- > 0 && serial_tail != serial_head) {
+    Serial.write(serial_buffer[serial_tail]);
+    serial_tail = (serial_tail + 1) % sizeof(serial_buffer);
+  }
+}
+
+void activationSerialLog(AsyncWebServerRequest *request) {
+  if (serial_log) {
+    request->send(200, F("text/html"), F("Done"));
+    return;
+  }
+
+  LittleFS.remove("/noserial.txt");
+  serial_log = true;
+
+  request->send(200, F("text/plain"), F("The serial output has been activated"));
+}
+
+void deactivationSerialLog(AsyncWebServerRequest *request) {
+  if (!serial_log) {
+    request->send(200, F("text/html"), F("Done"));
+    return;
+  }
+
+  File file = LittleFS.open("/noserial.txt", "w");
+  if (file) {
+    file.close();
+  }
+  serial_log = false;
+  serial_head = serial_tail;
+
+  request->send(200, F("text/plain"), F("The serial output has been deactivated"));
+}
+
 void note(String text) {
 
   String logs = strContains(text, "iDom") ? "\n[" : "[";
@@ -113,28 +734,18 @@ void note(String text) {
   }
   logs += "] " + text;
 
-  Serial.print("\n" + logs);
+  printSerial("\n" + logs);
 
+#if FEATURE_LOG
   if (keep_log) {
     File file = LittleFS.open("/log.txt", "a");
     if (file) {
+      indexTheLog(file.size());
       file.println(logs);
       file.close();
     }
   }
-}
-
-bool writeObjectToFile(String name, DynamicJsonDocument object) {
-  name = "/" + name + ".txt";
-  bool result = false;
-
-  File file = LittleFS.open(name, "w");
-  if (file && object.size() > 0) {
-    result = serializeJson(object, file) > 2;
-    file.close();
-  }
-
-  return result;
+#endif
 }
 
 String get1(String text, int index) {
@@ -152,43 +763,337 @@ String get1(String text, int index) {
   return found > index ? text.substring(str_index[0], str_index[1]) : "";
 }
 
+char getDayOfTheWeek(int day) {
+  return pgm_read_byte(&days_of_the_week[day][0]);
+}
+
 String getSmartString() {
   String result = smart_string;
   result.replace("&", "%26");
   return result;
 }
 
+int getBucket(uint32_t value) {
+  if (value < 4) {
+    return value;
+  }
+  int exponent = 31 - __builtin_clz(value);
+  return min((exponent - 1) * 4 + (int)((value >> (exponent - 2)) & 3), histogram_buckets - 1);
+}
+
+uint32_t getBucketLimit(int bucket) {
+  if (bucket < 4) {
+    return bucket;
+  }
+  int exponent = bucket / 4 + 1;
+  return ((uint32_t)(4 + bucket % 4) << (exponent - 2)) + ((uint32_t)1 << (exponent - 2)) - 1;
+}
+
+void addToHistogram(Histogram& histogram, uint32_t value) {
+  int bucket = getBucket(value);
+  if (histogram.buckets[bucket] == 0xffff) {
+    for (int i = 0; i < histogram_buckets; i++) {
+      histogram.buckets[i] /= 2;
+    }
+  }
+  histogram.buckets[bucket]++;
+  histogram.count++;
+  if (value > histogram.max) {
+    histogram.max = value;
+  }
+}
+
+uint32_t getPercentile(Histogram& histogram, int permille) {
+  uint32_t samples = 0;
+  for (int i = 0; i < histogram_buckets; i++) {
+    samples += histogram.buckets[i];
+  }
+  uint32_t rank = ((uint64_t)samples * permille + 999) / 1000;
+  uint32_t seen = 0;
+  for (int i = 0; i < histogram_buckets; i++) {
+    seen += histogram.buckets[i];
+    if (seen >= rank && seen > 0) {
+      return min(getBucketLimit(i), histogram.max);
+    }
+  }
+  return 0;
+}
+
+String getHistogram(Histogram& histogram) {
+  return String(F("{\"count\":")) + histogram.count
+  + F(",\"p50\":") + getPercentile(histogram, 500)
+  + F(",\"p99\":") + getPercentile(histogram, 990)
+  + F(",\"p999\":") + getPercentile(histogram, 999)
+  + F(",\"max\":") + histogram.max + F("}");
+}
+
+uint32_t getDayMillis() {
+  return (RTC.now().unixtime() - offset - (dst ? 3600 : 0)) % 86400 * 1000 + (millis() - tick_millis) % 1000;
+}
+
+void startTrace() {
+  trace_id = ESP.random();
+  trace_origin = getDayMillis();
+  trace_start = micros() | 1;
+}
+
+String getTrace() {
+  if (trace_start == 0 || !RTCisrunning()) {
+    return "";
+  }
+  return String(F("&trace=")) + String(trace_id, HEX) + "." + String(trace_origin);
+}
+
+void recordHop(String trace) {
+  if (!RTCisrunning() || trace.indexOf(".") == -1) {
+    return;
+  }
+
+  uint32_t origin = trace.substring(trace.indexOf(".") + 1).toInt();
+  uint32_t latency = (getDayMillis() + 86400000 - origin) % 86400000;
+  addToHistogram(hop_latency, min(latency, (uint32_t)4000000) * 1000);
+
+  recent_hops[hop_head] = {(uint16_t)strtoul(trace.c_str(), NULL, 16), data_source, latency};
+  hop_head = (hop_head + 1) % 4;
+}
+
+String getRecentHops() {
+  String result = "";
+  for (int i = 0; i < 4; i++) {
+    Hop& hop = recent_hops[(hop_head + 3 - i) % 4];
+    if (hop.ip != 0) {
+      result += String(result.length() > 0 ? "," : "") + String(hop.id, HEX) + "@" + IPAddress(hop.ip).toString() + ":" + String(hop.latency);
+    }
+  }
+  return "\"" + result + "\"";
+}
+
+bool deferTask(byte type) {
+#ifdef SIMULATOR
+  if (tasks_muted) {
+    return true;
+  }
+#endif
+
+  if (type == TASK_SAVE_SETTINGS) {
+    state_version++;
+  }
+
+  for (int i = 0; i < task_count; i++) {
+    if (tasks[(task_head + i) % 8] == type) {
+      return true;
+    }
+  }
+
+  if (task_count == 8) {
+    tasks_dropped++;
+    NOTE_ERROR(F("Task queue is full"));
+    return false;
+  }
+
+  tasks[(task_head + task_count) % 8] = type;
+  task_count++;
+  esp_schedule();
+  return true;
+}
+
+bool queueData(AsyncWebServerRequest *request) {
+  if (received_count == 4) {
+    tasks_dropped++;
+    return false;
+  }
+
+  int i = (received_head + received_count) % 4;
+  received_data[i] = getBody(request);
+  received_source[i] = request->client()->remoteIP();
+  received_count++;
+  return deferTask(TASK_READ_DATA);
+}
+
+void readReceivedData() {
+  String payload;
+
+  while (received_count > 0) {
+    payload = received_data[received_head];
+    received_data[received_head] = "";
+    data_source = received_source[received_head];
+    received_head = (received_head + 1) % 4;
+    received_count--;
+
+    readData(payload, true);
+  }
+  data_source = 0;
+}
+
+void queueOutbound(String data) {
+  String pair;
+  int start = 0;
+  int end;
+
+  while (start < (int)data.length()) {
+    end = data.indexOf('&', start);
+    if (end == -1) {
+      end = data.length();
+    }
+    pair = data.substring(start, end);
+    start = end + 1;
+
+    if (pair.startsWith("trace=")) {
+      outbound_trace = pair;
+    }
+
+    for (int k = 0; k < 3; k++) {
+      if (pair.startsWith(String(FPSTR(outbound_keys[k])) + "=")) {
+        if (outbound[k].length() > 0) {
+          outbound_merged++;
+        }
+        outbound[k] = pair;
+      }
+    }
+  }
+
+  if (outbound_since == 0) {
+    outbound_since = millis() | 1;
+    esp_schedule();
+  }
+}
+
+String takeOutbound(bool force) {
+  if (outbound_since == 0 || (!force && millis() - outbound_since < (uint32_t)outbound_window)) {
+    return "";
+  }
+
+  String result = "";
+  for (int k = 0; k < 3; k++) {
+    if (outbound[k].length() > 0) {
+      result += String(result.length() > 0 ? "&" : "") + outbound[k];
+      outbound[k] = "";
+    }
+  }
+  if (outbound_trace.length() > 0 && result.length() > 0) {
+    result += "&" + outbound_trace;
+  }
+  outbound_trace = "";
+  outbound_since = 0;
+  return result;
+}
+
+#if FEATURE_ONLINE
+void storeOutbox(String data) {
+  if (data.length() == 0) {
+    return;
+  }
+
+  File file = LittleFS.open("/outbox.txt", "a");
+  if (!file) {
+    NOTE_ERROR(F("The outbox cannot be written"));
+    return;
+  }
+
+  data.replace("&", "\n");
+  file.println(data);
+  bool full = file.size() > outbox_limit;
+  file.close();
+
+  outbox_pending = true;
+  outbox_stored++;
+
+  if (full) {
+    data = readOutbox();
+    data.replace("&", "\n");
+    file = LittleFS.open("/outbox.txt", "w");
+    if (file) {
+      file.println(data);
+      file.close();
+    }
+  }
+}
+
+String readOutbox() {
+  File file = LittleFS.open("/outbox.txt", "r");
+  if (!file) {
+    return "";
+  }
+
+  String latest[3];
+  String line;
+  while (file.available()) {
+    line = file.readStringUntil('\n');
+    line.trim();
+    for (int k = 0; k < 3; k++) {
+      if (line.startsWith(String(FPSTR(outbound_keys[k])) + "=")) {
+        latest[k] = line;
+      }
+    }
+  }
+  file.close();
+
+  String result = "";
+  for (int k = 0; k < 3; k++) {
+    if (latest[k].length() > 0) {
+      result += String(result.length() > 0 ? "&" : "") + latest[k];
+    }
+  }
+  return result;
+}
+#endif
+
 
 void connectingToWifi() {
-  String logs = "Connecting to Wi-Fi";
-  Serial.print("\n" + logs);
+  String logs = F("Connecting to Wi-Fi");
+  printSerial("\n" + logs);
+
 
+  uint32_t connect_start = millis();
+  bool result = false;
 
   WiFi.mode(WIFI_STA);
-  WiFi.disconnect();
-  delay(100);
 
-  WiFi.begin(ssid.c_str(), password.c_str());
+  if (wifi_channel > 0) {
+    bool lease = wifi_ip != 0 && uprisings - wifi_lease_boot < wifi_lease_boots;
+    if (lease) {
+      WiFi.config(IPAddress(wifi_ip), IPAddress(wifi_gateway), IPAddress(wifi_subnet), IPAddress(wifi_dns));
+    }
+    WiFi.begin(ssid.c_str(), password.c_str(), wifi_channel, wifi_bssid);
+    result = waitForWifi(4);
 
-  int timeout = 0;
-  while (timeout++ < 20 && WiFi.status() != WL_CONNECTED) {
-    delay(250);
-    Serial.print(".");
-    delay(250);
+    if (result && lease) {
+      wifi_static_since = millis() | 1;
+    }
+    if (!result) {
+      wifi_channel = 0;
+      wifi_ip = 0;
+      WiFi.config(IPAddress(0u), IPAddress(0u), IPAddress(0u));
+    }
+  }
+
+  if (!result) {
+    WiFi.disconnect();
+    delay(100);
+
+    WiFi.begin(ssid.c_str(), password.c_str());
+    result = waitForWifi(20);
   }
 
-  bool result = WiFi.status() == WL_CONNECTED;
+  wifi_connect_time = millis() - connect_start;
 
   if (result) {
-    logs = "Connected to " + WiFi.SSID();
-    logs += " : " + WiFi.localIP().toString();
+    logs = F("Connected to ");
+    logs += WiFi.SSID();
+    logs += F(" : ");
+    logs += WiFi.localIP().toString();
+    logs += F(" in ");
+    logs += wifi_connect_time;
+    logs += F(" ms");
   } else {
-    logs += " timed out";
+    logs += F(" timed out");
   }
-  note(logs);
+  NOTE_INFO(logs);
 
   if (result) {
+    markBootPhase(BOOT_WIFI);
     WiFi.setAutoReconnect(true);
+    cacheWifi();
 
     startServices();
     sayHelloToTheServer();
@@ -199,8 +1104,9 @@ void connectingToWifi() {
 }
 
 void initiatingWPS() {
-  String logs = "Initiating WPS";
-  Serial.print("\n" + logs);
+  Section section(SECTION_WPS);
+  String logs = F("Initiating WPS");
+  printSerial("\n" + logs);
 
 
   WiFi.persistent(false);
@@ -209,27 +1115,23 @@ void initiatingWPS() {
   WiFi.begin();
   WiFi.beginWPSConfig();
 
-  int timeout = 0;
-  while (timeout++ < 20 && WiFi.status() != WL_CONNECTED) {
-    delay(250);
-    Serial.print(".");
-    delay(250);
-  }
-
-  bool result = WiFi.status() == WL_CONNECTED;
+  bool result = waitForWifi(20);
 
   if (result) {
     ssid = WiFi.SSID();
     password = WiFi.psk();
 
-    logs += " finished. ";
-    logs += "Connected to " + WiFi.SSID();
+    logs += F(" finished. ");
+    logs += F("Connected to ");
+    logs += WiFi.SSID();
   } else {
-    logs += " timed out";
+    logs += F(" timed out");
   }
-  note(logs);
+  NOTE_INFO(logs);
 
   if (result) {
+    markBootPhase(BOOT_WIFI);
+    cacheWifi();
     saveSettings();
     startServices();
     sayHelloToTheServer();
@@ -245,10 +1147,166 @@ void initiatingWPS() {
   }
 }
 
+bool waitForWifi(int timeout) {
+  while (timeout-- > 0 && WiFi.status() != WL_CONNECTED) {
+    delay(250);
+    printSerial(".");
+    delay(250);
+  }
+  return WiFi.status() == WL_CONNECTED;
+}
 
-void activationTheLog() {
+void cacheWifi() {
+  bool renewed = wifi_static_since == 0;
+  if (memcmp(wifi_bssid, WiFi.BSSID(), 6) == 0 && wifi_channel == WiFi.channel() && wifi_ip == (uint32_t)WiFi.localIP() && !renewed) {
+    return;
+  }
+
+  if (renewed) {
+    wifi_lease_boot = uprisings;
+  }
+
+  memcpy(wifi_bssid, WiFi.BSSID(), 6);
+  wifi_channel = WiFi.channel();
+  wifi_ip = WiFi.localIP();
+  wifi_gateway = WiFi.gatewayIP();
+  wifi_subnet = WiFi.subnetMask();
+  wifi_dns = WiFi.dnsIP();
+  deferTask(TASK_SAVE_SETTINGS);
+}
+
+void renewLease() {
+  if (wifi_renewing) {
+    if (WiFi.status() == WL_CONNECTED && (uint32_t)WiFi.localIP() != 0) {
+      wifi_renewing = false;
+      cacheWifi();
+    }
+    return;
+  }
+
+  if (wifi_static_since == 0 || millis() - wifi_static_since < wifi_lease_time) {
+    return;
+  }
+
+  NOTE_INFO(F("Renewing the Wi-Fi lease"));
+  wifi_static_since = 0;
+  wifi_renewing = true;
+  WiFi.config(IPAddress(0u), IPAddress(0u), IPAddress(0u));
+}
+
+
+void receiveBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+  if (total > body_limit) {
+    return;
+  }
+
+  if (index == 0) {
+    request->_tempObject = malloc(total + 1);
+  }
+  if (request->_tempObject != NULL) {
+    memcpy((uint8_t*)request->_tempObject + index, data, len);
+    if (index + len == total) {
+      ((char*)request->_tempObject)[total] = 0;
+    }
+  }
+}
+
+bool hasBody(AsyncWebServerRequest *request) {
+  return request->_tempObject != NULL;
+}
+
+String getBody(AsyncWebServerRequest *request) {
+  return hasBody(request) ? String((char*)request->_tempObject) : "";
+}
+
+bool isBodyTooLarge(AsyncWebServerRequest *request) {
+  if (request->contentLength() <= body_limit) {
+    return false;
+  }
+
+  request_errors++;
+  request->send(413, F("text/plain"), F("Body too large"));
+  return true;
+}
+
+bool isValidData(String payload) {
+  ArenaJsonDocument json_object(1024);
+  return !deserializeJson(json_object, payload) && !json_object.isNull();
+}
+
+
+bool takeToken(Bucket& bucket, int rate, int burst) {
+  uint32_t now = millis();
+  // Past the time to refill a full bucket the elapsed time doesn't matter, clamping it first keeps the product in range.
+  uint32_t elapsed = min(now - bucket.refill, (uint32_t)burst * 1000 / rate);
+  bucket.tokens = min(bucket.tokens + (int32_t)(elapsed * rate), (int32_t)burst * 1000);
+  bucket.refill = now;
+
+  if (bucket.tokens < 1000) {
+    return false;
+  }
+  bucket.tokens -= 1000;
+  return true;
+}
+
+bool admitRequest(AsyncWebServerRequest *request) {
+  uint32_t ip = request->client()->remoteIP();
+  int slot = 0;
+
+  for (int i = 0; i < 8; i++) {
+    if (client_buckets[i].ip == ip) {
+      slot = i;
+      break;
+    }
+    if (client_buckets[i].refill < client_buckets[slot].refill) {
+      slot = i;
+    }
+  }
+  if (client_buckets[slot].ip != ip) {
+    client_buckets[slot] = {ip, client_burst * 1000, (uint32_t)millis()};
+  }
+
+  if (!takeToken(client_buckets[slot], client_rate, client_burst)) {
+    requests_throttled++;
+    request->send(429, F("text/plain"), F("Too many requests"));
+    return false;
+  }
+  if (hasBody(request) && !takeToken(global_bucket, global_rate, global_burst)) {
+    requests_overloaded++;
+    request->send(429, F("text/plain"), F("Device busy"));
+    return false;
+  }
+  return true;
+}
+
+
+String getETag() {
+  return "\"" + String(state_epoch, HEX) + "-" + String(state_version) + "\"";
+}
+
+bool isNotModified(AsyncWebServerRequest *request) {
+  if (!request->hasHeader(F("If-None-Match")) || request->getHeader(F("If-None-Match"))->value() != getETag()) {
+    return false;
+  }
+
+  AsyncWebServerResponse *response = request->beginResponse(304);
+  response->addHeader(F("ETag"), getETag());
+  request->send(response);
+  not_modified++;
+  return true;
+}
+
+void sendWithETag(AsyncWebServerRequest *request, String reply) {
+  AsyncWebServerResponse *response = request->beginResponse(200, F("text/plain"), reply);
+  response->addHeader(F("ETag"), getETag());
+  request->send(response);
+}
+
+
+#if FEATURE_LOG
+void activationTheLog(AsyncWebServerRequest *request) {
   if (keep_log) {
-    server.send(200, "text/html", "Done");
+    request->send(200, F("text/html"), F("Done"));
     return;
   }
 
@@ -259,91 +1317,178 @@ void activationTheLog() {
   }
   keep_log = true;
 
-  server.send(200, "text/plain", "The log has been activated");
+  request->send(200, F("text/plain"), F("The log has been activated"));
 }
 
-void deactivationTheLog() {
+void deactivationTheLog(AsyncWebServerRequest *request) {
   if (!keep_log) {
-    server.send(200, "text/html", "Done");
+    request->send(200, F("text/html"), F("Done"));
     return;
   }
 
   if (LittleFS.exists("/log.txt")) {
     LittleFS.remove("/log.txt");
   }
+  LittleFS.remove("/log.idx");
+  log_indexed = -1;
   keep_log = false;
 
-  server.send(200, "text/plain", "The log has been deactivated");
+  request->send(200, F("text/plain"), F("The log has been deactivated"));
 }
 
-void requestForLogs() {
-  File file = LittleFS.open("/log.txt", "r");
-  if (!file) {
-    server.send(404, "text/plain", "No log file");
+void requestForLogs(AsyncWebServerRequest *request) {
+  Section section(SECTION_LOGS);
+  if (!LittleFS.exists("/log.txt")) {
+    request->send(404, F("text/plain"), F("No log file"));
     return;
   }
 
-  server.setContentLength(file.size() + String("Log file\nHTTP/1.1 200 OK").length());
-  server.send(200, "text/html", "Log file\n");
-  while (file.available()) {
-    server.sendContent(String(char(file.read())));
+  if (!request->hasParam(F("from")) && !request->hasParam(F("to"))) {
+    request->send(LittleFS, F("/log.txt"), F("text/plain"));
+    return;
   }
-  file.close();
 
-  server.send(200, "text/html", "Done");
+  uint32_t from = request->hasParam(F("from")) ? request->getParam(F("from"))->value().toInt() : 0;
+  uint32_t to = request->hasParam(F("to")) ? request->getParam(F("to"))->value().toInt() : UINT32_MAX;
+  uint32_t start;
+  uint32_t end;
+  if (!findLogRange(from, to, start, end)) {
+    request->send(LittleFS, F("/log.txt"), F("text/plain"));
+    return;
+  }
+
+  File file = LittleFS.open("/log.txt", "r");
+  end = min(end, (uint32_t)file.size());
+  start = min(start, end);
+  file.seek(start);
+
+  request->send(request->beginResponse(F("text/plain"), end - start, [file, end, start](uint8_t *buffer, size_t max_length, size_t index) mutable -> size_t {
+    return file.read(buffer, min(max_length, (size_t)(end - start - index)));
+  }));
 }
 
-void clearTheLog() {
+void clearTheLog(AsyncWebServerRequest *request) {
   File file = LittleFS.open("/log.txt", "w");
   if (!file) {
-    server.send(404, "text/plain", "Failed!");
+    request->send(404, F("text/plain"), F("Failed!"));
     return;
   }
 
   file.println();
   file.close();
+  LittleFS.remove("/log.idx");
+  log_indexed = -1;
+  log_indexed_time = 0;
+
+  request->send(200, F("text/plain"), F("The log file was cleared"));
+}
+
+void indexTheLog(uint32_t position) {
+  if (!RTCisrunning()) {
+    return;
+  }
+
+  uint32_t time = RTC.now().unixtime() - offset - (dst ? 3600 : 0);
+  if (log_indexed >= 0 && position - log_indexed < log_block && time >= log_indexed_time) {
+    return;
+  }
+
+  File file = LittleFS.open("/log.idx", "a");
+  if (!file) {
+    return;
+  }
+
+  LogIndex record = {time, position};
+  file.write((uint8_t*)&record, sizeof(record));
+  file.close();
+  log_indexed = position;
+  log_indexed_time = time;
+}
+
+bool findLogRange(uint32_t from, uint32_t to, uint32_t& start, uint32_t& end) {
+  File file = LittleFS.open("/log.idx", "r");
+  if (!file) {
+    return false;
+  }
+
+  // A block lasts from its record to the next one, or open-ended when the next one starts after a clock set back.
+  // The range spans from the first to the last block overlapping the query.
+  LogIndex block;
+  LogIndex next;
+  bool found = false;
+  bool matched = false;
+  start = 0;
+  end = 0;
+
+  if (file.read((uint8_t*)&block, sizeof(block)) == sizeof(block)) {
+    found = true;
+    bool more = true;
+    while (more) {
+      more = file.read((uint8_t*)&next, sizeof(next)) == sizeof(next);
+      uint32_t block_end = more && next.time >= block.time ? next.time : UINT32_MAX;
+      if (block.time <= to && block_end >= from) {
+        start = matched ? min(start, block.offset) : block.offset;
+        end = more ? max(end, next.offset) : UINT32_MAX;
+        matched = true;
+      }
+      block = next;
+    }
+  }
+  file.close();
 
-  server.send(200, "text/plain", "The log file was cleared");
+  return found;
 }
+#endif
 
 
+#if FEATURE_GEO
 void getSunriseSunset(int day) {
+  Section section(SECTION_SUN);
   if (WiFi.status() != WL_CONNECTED || geo_location.length() < 2) {
     return;
   }
 
-  String location = "lat=" + geo_location;
-  location.replace("x", "&lng=");
+  String location = String(F("lat=")) + geo_location;
+  location.replace(F("x"), F("&lng="));
 
-  HTTP.begin("http://api.sunrise-sunset.org/json?" + location);
-  HTTP.addHeader("Content-Type", "text/plain");
+  HTTP.begin(String(F("http://api.sunrise-sunset.org/json?")) + location);
+  HTTP.addHeader(F("Content-Type"), F("text/plain"));
 
   if (HTTP.GET() == HTTP_CODE_OK) {
-    DynamicJsonDocument json_object(1024);
+    ArenaJsonDocument json_object(1024);
     deserializeJson(json_object, HTTP.getString());
-    JsonObject object = json_object["results"];
+    JsonObject object = json_object[F("results")];
 
-    if (object.containsKey("sunrise") && object.containsKey("sunset")) {
-      String data = object["sunrise"].as<String>();
+    if (object.containsKey(F("sunrise")) && object.containsKey(F("sunset"))) {
+      String data = object[F("sunrise")].as<String>();
       next_sunrise = ((data.substring(0, data.indexOf(":")).toInt() + (strContains(data, "PM") ? 12 : 0) + (offset > 0 ? offset / 3600 : 0) + (dst ? 1 : 0)) * 60) + data.substring(data.indexOf(":") + 1, data.indexOf(":") + 3).toInt();
       next_sunrise += dawn_delay;
 
-      data = object["sunset"].as<String>();
+      data = object[F("sunset")].as<String>();
       next_sunset = ((data.substring(0, data.indexOf(":")).toInt() + (strContains(data, "PM") ? 12 : 0) + (offset > 0 ? offset / 3600 : 0) + (dst ? 1 : 0)) * 60) + data.substring(data.indexOf(":") + 1, data.indexOf(":") + 3).toInt();
       next_sunset += dusk_delay;
 
       last_sun_check = day;
-      note("Sunset: " + String(next_sunset) + " / Sunrise: " + String(next_sunrise));
+      state_version++;
+      NOTE_INFO(String(F("Sunset: ")) + String(next_sunset) + F(" / Sunrise: ") + String(next_sunrise));
     }
   }
 
   HTTP.end();
 }
+#endif
 
 int findMDNSDevices() {
-  int n = MDNS.queryService("idom", "tcp");
+  Section section(SECTION_MDNS);
+  int n = 0;
   String ip;
 
+  if (!static_devices && (last_discovery == 0 || millis() - last_discovery > discovery_interval)) {
+    n = MDNS.queryService("idom", "tcp");
+    last_discovery = millis();
+    discoveries++;
+  }
+
   if (n > 0) {
     for (int i = 0; i < n; ++i) {
       ip = String(MDNS.IP(i)[0]) + '.' + String(MDNS.IP(i)[1]) + '.' + String(MDNS.IP(i)[2]) + '.' + String(MDNS.IP(i)[3]);
@@ -353,6 +1498,10 @@ int findMDNSDevices() {
     }
   }
 
+  return countDevices();
+}
+
+int countDevices() {
   if (devices.length() > 0) {
     int count = 1;
     for (byte b: devices) {
@@ -366,14 +1515,50 @@ int findMDNSDevices() {
   }
 }
 
-void receivedOfflineData() {
-  if (server.hasArg("plain")) {
-    server.send(200, "text/plain", "Data has received");
-    readData(server.arg("plain"), true);
+bool isDeviceList(String list) {
+  IPAddress ip;
+  int count = 0;
+  int start = 0;
+  int end;
+
+  while (start < (int)list.length()) {
+    end = list.indexOf(',', start);
+    if (end == -1) {
+      end = list.length();
+    }
+    if (++count > devices_limit || !ip.fromString(list.substring(start, end))) {
+      return false;
+    }
+    start = end + 1;
+  }
+  return !list.endsWith(",");
+}
+
+void receivedOfflineData(AsyncWebServerRequest *request) {
+  uint32_t start = micros();
+
+  if (!admitRequest(request)) {
     return;
   }
 
-  server.send(200, "text/plain", "Body not received");
+  if (isBodyTooLarge(request)) {
+    return;
+  }
+
+  if (!hasBody(request)) {
+    request_errors++;
+    request->send(200, F("text/plain"), F("Body not received"));
+  } else if (!isValidData(getBody(request))) {
+    request_errors++;
+    request->send(400, F("text/plain"), F("Parsing failed"));
+  } else if (!queueData(request)) {
+    requests_overloaded++;
+    request->send(503, F("text/plain"), F("Device busy"));
+  } else {
+    request->send(200, F("text/plain"), F("Data has received"));
+  }
+
+  addToHistogram(set_latency, micros() - start);
 }
 
 void putOfflineData(String url, String data) {
@@ -383,18 +1568,21 @@ void putOfflineData(String url, String data) {
 
   String logs;
 
-  HTTP.begin(WIFI, "http://" + url + "/set");
+  HTTP.begin(WIFI, String(F("http://")) + url + F("/set"));
   int http_code = HTTP.PUT(data);
 
+  messages_sent++;
   if (http_code == HTTP_CODE_OK) {
     logs = url + ": " + data;
   } else {
+    messages_failed++;
+    last_discovery = 0;
     logs = url + " - error "  + http_code;
   }
 
   HTTP.end();
 
-  note("Data transfer to:\n" + logs);
+  NOTE_INFO(String(F("Data transfer to:\n")) + logs);
 }
 
 void putMultiOfflineData(String data) {
@@ -414,80 +1602,244 @@ void putMultiOfflineData(String data) {
   for (int i = 0; i < count; i++) {
     ip = get1(devices, i);
 
-    HTTP.begin(WIFI, "http://" + ip + "/set");
+    HTTP.begin(WIFI, String(F("http://")) + ip + F("/set"));
     http_code = HTTP.PUT(data);
 
+    messages_sent++;
     if (http_code == HTTP_CODE_OK) {
       logs += "\n " + ip + ": " + data;
     } else {
+      messages_failed++;
+      last_discovery = 0;
       logs += "\n " + ip + " - error "  + http_code;
     }
 
     HTTP.end();
   }
 
-  note("Data transfer to " + String(count) + ":" + logs);
+  NOTE_INFO(String(F("Data transfer to ")) + String(count) + F(":") + logs);
 }
 
 void getOfflineData() {
+  Section section(SECTION_SYNC);
   if (WiFi.status() != WL_CONNECTED) {
     return;
   }
 
-  int count = findMDNSDevices();
+  int count = min(findMDNSDevices(), devices_limit);
   if (count == 0) {
     return;
   }
 
-  String ip;
-  int http_code;
-  String data;
-  String logs = "";
+  PROGRESS();
+  SyncReply* replies = new SyncReply[count];
+  IPAddress ip;
+  String body;
 
   for (int i = 0; i < count; i++) {
-    ip = get1(devices, i);
+    replies[i].ip = get1(devices, i);
+    ip.fromString(replies[i].ip);
+    SyncCursor& cursor = getCursor(ip);
+    body = String(F("{\"id\":\"")) + WiFi.macAddress() + F("\",\"since\":") + String(cursor.sequence) + F(",\"epoch\":") + String(cursor.epoch) + F("}");
+    replies[i].request = String(F("POST /basicdata HTTP/1.1\r\nHost: ")) + replies[i].ip
+    + F("\r\nContent-Type: text/plain\r\nContent-Length: ") + body.length()
+    + F("\r\nConnection: close\r\n\r\n") + body;
+
+    replies[i].client = new AsyncClient();
+    replies[i].client->onConnect([](void* arg, AsyncClient* client) {
+      client->write(((SyncReply*)arg)->request.c_str());
+    }, &replies[i]);
+    replies[i].client->onData([](void* arg, AsyncClient* client, void* data, size_t len) {
+      ((SyncReply*)arg)->data.concat((char*)data, len);
+    }, &replies[i]);
+    replies[i].client->onDisconnect([](void* arg, AsyncClient* client) {
+      ((SyncReply*)arg)->done = true;
+    }, &replies[i]);
+    replies[i].client->onError([](void* arg, AsyncClient* client, int8_t error) {
+      ((SyncReply*)arg)->done = true;
+    }, &replies[i]);
+
+    if (!ip.fromString(replies[i].ip) || !replies[i].client->connect(ip, 80)) {
+      replies[i].done = true;
+    }
+    messages_sent++;
+  }
 
-    HTTP.begin(WIFI, "http://" + ip + "/basicdata");
-    http_code = HTTP.POST("{\"id\":\"" + String(WiFi.macAddress()) + "\"}");
+  int quorum = min(count, sync_quorum);
+  int accepted = -1;
+  int first = -1;
+  uint32_t deadline = millis() + sync_timeout;
+
+  PROGRESS();
+  while (accepted == -1 && (int32_t)(deadline - millis()) > 0) {
+    delay(10);
+
+    bool pending = false;
+    for (int i = 0; i < count; i++) {
+      if (!replies[i].done) {
+        pending = true;
+      } else if (!replies[i].parsed) {
+        parseSyncReply(replies[i]);
+        if (replies[i].valid && first == -1) {
+          first = i;
+        }
+      }
+    }
 
-    if (http_code == HTTP_CODE_OK) {
-      if (HTTP.getSize() > 15) {
-        data = HTTP.getString();
-        logs +=  "\n " + ip + ": " + data;
-        readData(data, true);
+    for (int i = 0; i < count && accepted == -1; i++) {
+      int agreeing = 0;
+      for (int j = 0; j < count && replies[i].valid; j++) {
+        if (replies[j].valid && abs((int32_t)(replies[j].time - replies[i].time)) <= 60) {
+          agreeing++;
+        }
+      }
+      if (agreeing >= quorum) {
+        accepted = i;
       }
-    } else {
-      logs += "\n " + ip + ": error " + http_code;
     }
 
-    HTTP.end();
+    if (!pending) {
+      break;
+    }
+  }
+
+  String logs = "";
+  for (int i = 0; i < count; i++) {
+    replies[i].client->onConnect(NULL);
+    replies[i].client->onData(NULL);
+    replies[i].client->onDisconnect(NULL);
+    replies[i].client->onError(NULL);
+    replies[i].client->close(true);
+    delete replies[i].client;
+
+    if (!replies[i].valid) {
+      messages_failed++;
+      last_discovery = 0;
+    }
+    logs += "\n " + replies[i].ip + (replies[i].valid ? ": " + replies[i].data : (replies[i].done ? String(F(": error")) : String(F(": cancelled"))));
   }
 
-  note("Received data..." + logs);
+  if (accepted == -1) {
+    accepted = first;
+  }
+
+  PROGRESS();
+  bool advanced = false;
+  for (int i = 0; i < count; i++) {
+    if (!replies[i].valid || replies[i].sequence == 0) {
+      continue;
+    }
+    if (i != accepted) {
+      readData(replies[i].zone, true, true);
+    }
+
+    ip.fromString(replies[i].ip);
+    SyncCursor& cursor = getCursor(ip);
+    if (cursor.sequence != replies[i].sequence || cursor.epoch != replies[i].epoch) {
+      cursor.sequence = replies[i].sequence;
+      cursor.epoch = replies[i].epoch;
+      advanced = true;
+    }
+  }
+  if (accepted > -1) {
+    readData(replies[accepted].data, true, true);
+  }
+  if (advanced) {
+    deferTask(TASK_SAVE_SETTINGS);
+  }
+  delete [] replies;
+
+  NOTE_INFO(String(F("Received data...")) + logs);
 }
 
+void parseSyncReply(SyncReply& reply) {
+  reply.parsed = true;
+  int body = reply.data.indexOf(F("\r\n\r\n"));
+  if (body == -1 || !reply.data.startsWith(F("HTTP/1.1 200"))) {
+    return;
+  }
+  reply.data = reply.data.substring(body + 4);
+
+  ArenaJsonDocument json_object(384);
+  deserializeJson(json_object, reply.data);
+  if (json_object.isNull() || !(json_object.containsKey(F("offset")) || json_object.containsKey(F("seq")))) {
+    return;
+  }
+
+  reply.offset = json_object[F("offset")].as<int>();
+  reply.dst = strContains(json_object[F("dst")].as<String>(), "1");
+  reply.time = json_object.containsKey(F("time")) ? json_object[F("time")].as<uint32_t>() : 0;
+  reply.sequence = json_object[F("seq")].as<uint32_t>();
+  reply.epoch = json_object[F("epoch")].as<uint32_t>();
+  reply.valid = true;
+
+  // Only the accepted reply sets the clock, the stamped fields of the others are merged without it.
+  json_object.remove(F("time"));
+  serializeJson(json_object, reply.zone);
+}
+
+bool takeStamp(Stamp& stamp, uint32_t remote, bool peer, bool tie) {
+  sync_clock = max(sync_clock, remote >> 8);
+
+  if (remote == 0 && !peer) {
+    stamp.lamport = (++sync_clock << 8) | (ESP.getChipId() & 0xff);
+  } else if (remote > stamp.lamport || (remote != 0 && remote == stamp.lamport && tie)) {
+    stamp.lamport = remote;
+  } else {
+    return false;
+  }
+
+  stamp.sequence = ++sync_sequence;
+  return true;
+}
+
+bool isChanged(Stamp& stamp, uint32_t since) {
+  return since == 0 || stamp.sequence > since;
+}
+
+SyncCursor& getCursor(uint32_t ip) {
+  int slot = 0;
+  for (int i = 0; i < 8; i++) {
+    if (sync_cursors[i].ip == ip) {
+      return sync_cursors[i];
+    }
+    if (sync_cursors[i].sequence < sync_cursors[slot].sequence) {
+      slot = i;
+    }
+  }
+
+  sync_cursors[slot] = {ip, 0, 0};
+  return sync_cursors[slot];
+}
+
+#if FEATURE_OTA
 void setupOTA() {
   ArduinoOTA.setHostname(host_name);
 
+  ArduinoOTA.onStart([]() {
+    flushOutbound(true);
+  });
+
   ArduinoOTA.onEnd([]() {
-    note("Software update over Wi-Fi");
+    NOTE_INFO(F("Software update over Wi-Fi"));
   });
 
   ArduinoOTA.onError([](ota_error_t error) {
-    String log = "OTA ";
+    String log = F("OTA ");
     if (error == OTA_AUTH_ERROR) {
-      log += "Auth";
+      log += F("Auth");
     } else if (error == OTA_BEGIN_ERROR) {
-      log += "Begin";
+      log += F("Begin");
     } else if (error == OTA_CONNECT_ERROR) {
-      log += "Connect";
+      log += F("Connect");
     } else if (error == OTA_RECEIVE_ERROR) {
-      log += "Receive";
+      log += F("Receive");
     } else if (error == OTA_END_ERROR) {
-      log += "End";
+      log += F("End");
     }
-    note(log + String(" failed!"));
+    NOTE_ERROR(log + F(" failed!"));
   });
 
   ArduinoOTA.begin();
 }
+#endif
@@ -1,32 +1,47 @@
 #include <c_online.h>
+#ifdef SIMULATOR
+#include "simulator.h"
+#endif
 
 void setup() {
+  restoreRelays();
+  markBootPhase(BOOT_RELAYS);
+  state_epoch = ESP.random();
+
   pinMode(led_pin, OUTPUT);
   digitalWrite(led_pin, HIGH);
 
   Serial.begin(115200);
-  while (!Serial) {}
 
   LittleFS.begin();
   Wire.begin();
+  markBootPhase(BOOT_FILESYSTEM);
 
+  serial_log = !LittleFS.exists("/noserial.txt");
+#if FEATURE_LOG
   keep_log = LittleFS.exists("/log.txt");
-
-  note("iDom Switch ." + String(version));
+#endif
+#if FEATURE_ONLINE
+  outbox_pending = LittleFS.exists("/outbox.txt");
   offline = !LittleFS.exists("/online.txt");
-  Serial.print(offline ? " OFFLINE" : " ONLINE");
+#endif
+
+  NOTE_INFO(String(F("iDom Switch .")) + String(version));
+  readPostmortem();
+  NOTE_DEBUG(String(F("Profile ")) + F(PROFILE_NAME) + F(", sketch ") + ESP.getSketchSize() + F(", free heap ") + ESP.getFreeHeap());
+  printSerial(offline ? F(" OFFLINE") : F(" ONLINE"));
 
   sprintf(host_name, "switch_%s", String(WiFi.macAddress()).c_str());
   WiFi.hostname(host_name);
-
-  for (int i = 0; i < 2; i++) {
-    pinMode(relay_pin[i], OUTPUT);
-  }
+  WiFi.setSleepMode(WIFI_MODEM_SLEEP);
 
   if (!readSettings(0)) {
     readSettings(1);
   }
+  readUprisings();
   setLights("restore", false);
+  saveRelayRecord();
+  markBootPhase(BOOT_SETTINGS);
 
   if (RTCisrunning()) {
     start_time = RTC.now().unixtime() - offset - (dst ? 3600 : 0);
@@ -34,8 +49,14 @@ void setup() {
 
   button1.setPushedCallback(&button1Single, (void*)"");
   button2.setPushedCallback(&button2Single, (void*)"");
+  for (int i = 0; i < 2; i++) {
+    attachInterrupt(digitalPinToInterrupt(button_pin[i]), buttonEdge, CHANGE);
+  }
 
+#if FEATURE_OTA
   setupOTA();
+#endif
+  markBootPhase(BOOT_OTA);
 
   if (ssid != "" && password != "") {
     connectingToWifi();
@@ -45,10 +66,123 @@ void setup() {
 }
 
 
+void restoreRelays() {
+  RelayRecord record;
+  EEPROM.begin(sizeof(record));
+  EEPROM.get(0, record);
+
+  if (record.magic == relay_record_magic && record.restore) {
+    light1 = record.light1;
+    light2 = record.light2;
+  }
+
+  for (int i = 0; i < 2; i++) {
+    pinMode(relay_pin[i], OUTPUT);
+  }
+  digitalWrite(relay_pin[0], light1);
+  digitalWrite(relay_pin[1], light2);
+  relay_light1 = light1;
+  relay_light2 = light2;
+}
+
+void saveRelayRecord() {
+  RelayRecord record = {relay_record_magic, restore_on_power_loss, light1, light2};
+  EEPROM.put(0, record);
+  EEPROM.commit();
+}
+
 bool readSettings(bool backup) {
+  File file = LittleFS.open(backup ? "/backup.bin" : "/settings.bin", "r");
+  if (!file) {
+    return readLegacySettings(backup);
+  }
+
+  SettingsImage image;
+  memset(&image, 0, sizeof(image));
+
+  bool result = file.read((uint8_t*)&image, 8) == 8 && image.magic == settings_magic && image.size >= 8;
+  uint32_t crc = 0xffffffff;
+  uint8_t buffer[32];
+  size_t length;
+
+  if (result) {
+    length = min((size_t)image.size, sizeof(image)) - 8;
+    result = file.read((uint8_t*)&image + 8, length) == length;
+    crc = crc32(&image, length + 8, crc);
+
+    for (size_t left = image.size - length - 8; left > 0 && result; left -= length) {
+      length = min(left, sizeof(buffer));
+      result = file.read(buffer, length) == length;
+      crc = crc32(buffer, length, crc);
+    }
+  }
+
+  String smart = "";
+  if (result) {
+    smart.reserve(image.smart_length);
+    for (size_t left = image.smart_length; left > 0 && result; left -= length) {
+      length = min((size_t)left, sizeof(buffer));
+      result = file.read(buffer, length) == length;
+      crc = crc32(buffer, length, crc);
+      smart.concat((char*)buffer, length);
+    }
+  }
+
+  uint32_t stored_crc = 0;
+  result = result && file.read((uint8_t*)&stored_crc, 4) == 4 && stored_crc == crc;
+  file.close();
+
+  if (!result) {
+    NOTE_ERROR(String(backup ? F("Backup") : F("Settings")) + F(" file error"));
+    return false;
+  }
+
+  image.ssid[sizeof(image.ssid) - 1] = 0;
+  image.password[sizeof(image.password) - 1] = 0;
+  image.location[sizeof(image.location) - 1] = 0;
+
+  ssid = image.ssid;
+  password = image.password;
+  smart_string = smart;
+  setSmart();
+  offset = image.offset;
+  dst = image.dst;
+  restore_on_power_loss = image.restore;
+  dusk_delay = image.dusk_delay;
+  dawn_delay = image.dawn_delay;
+  geo_location = image.location;
+  also_sensors = image.sensors;
+  outbound_window = constrain(image.window, 0, outbound_window_limit);
+
+  sync_clock = image.sync_clock;
+  sync_sequence = image.sync_sequence;
+  offset_stamp = {image.offset_stamp[0], image.offset_stamp[1]};
+  dst_stamp = {image.dst_stamp[0], image.dst_stamp[1]};
+  for (int i = 0; i < 8; i++) {
+    sync_cursors[i] = {image.cursor_ip[i], image.cursor_sequence[i], image.cursor_epoch[i]};
+  }
+
+  memcpy(wifi_bssid, image.bssid, 6);
+  wifi_channel = image.channel;
+  wifi_ip = image.ip;
+  wifi_gateway = image.gateway;
+  wifi_subnet = image.subnet;
+  wifi_dns = image.dns;
+  wifi_lease_boot = image.lease_boot;
+
+  if (restore_on_power_loss) {
+    light1 = image.light1;
+    light2 = image.light2;
+  }
+
+  NOTE_INFO(String(F("Reading the ")) + String(backup ? F("backup") : F("settings")) + F(" file, layout ") + String(image.layout));
+  return true;
+}
+
+bool readLegacySettings(bool backup) {
   File file = LittleFS.open(backup ? "/backup.txt" : "/settings.txt", "r");
   if (!file) {
-    note("The " + String(backup ? "backup" : "settings") + " file cannot be read");
+    NOTE_ERROR(String(F("The ")) + String(backup ? F("backup") : F("settings")) + F(" file cannot be read"));
     return false;
   }
 
@@ -56,102 +190,191 @@ bool readSettings(bool backup) {
   deserializeJson(json_object, file.readString());
 
   if (json_object.isNull() || json_object.size() < 5) {
-    note(String(backup ? "Backup" : "Settings") + " file error");
+    NOTE_ERROR(String(backup ? F("Backup") : F("Settings")) + F(" file error"));
     file.close();
     return false;
   }
 
-  file.seek(0);
-  note("Reading the " + String(backup ? "backup" : "settings") + " file:\n " + file.readString());
+  NOTE_INFO(String(F("Migrating the ")) + String(backup ? F("backup") : F("settings")) + F(" file"));
   file.close();
 
-  if (json_object.containsKey("ssid")) {
-    ssid = json_object["ssid"].as<String>();
+  if (json_object.containsKey(F("ssid"))) {
+    ssid = json_object[F("ssid")].as<String>();
   }
-  if (json_object.containsKey("password")) {
-    password = json_object["password"].as<String>();
+  if (json_object.containsKey(F("password"))) {
+    password = json_object[F("password")].as<String>();
   }
 
-  if (json_object.containsKey("smart")) {
-    smart_string = json_object["smart"].as<String>();
+  if (json_object.containsKey(F("smart"))) {
+    smart_string = json_object[F("smart")].as<String>();
     setSmart();
   }
-  if (json_object.containsKey("uprisings")) {
-    uprisings = json_object["uprisings"].as<int>() + 1;
+  if (json_object.containsKey(F("uprisings"))) {
+    uprisings = json_object[F("uprisings")].as<int>() + 1;
   }
-  if (json_object.containsKey("offset")) {
-    offset = json_object["offset"].as<int>();
+  if (json_object.containsKey(F("offset"))) {
+    offset = json_object[F("offset")].as<int>();
   }
-  if (json_object.containsKey("dst")) {
-    dst = json_object["dst"].as<bool>();
+  if (json_object.containsKey(F("dst"))) {
+    dst = json_object[F("dst")].as<bool>();
   }
-  if (json_object.containsKey("restore")) {
-    restore_on_power_loss = json_object["restore"].as<bool>();
+  if (json_object.containsKey(F("restore"))) {
+    restore_on_power_loss = json_object[F("restore")].as<bool>();
   }
-  if (json_object.containsKey("dawn_delay")) {
-    dawn_delay = json_object["dawn_delay"].as<int>();
+  if (json_object.containsKey(F("dawn_delay"))) {
+    dawn_delay = json_object[F("dawn_delay")].as<int>();
   }
-  if (json_object.containsKey("dusk_delay")) {
-    dusk_delay = json_object["dusk_delay"].as<int>();
+  if (json_object.containsKey(F("dusk_delay"))) {
+    dusk_delay = json_object[F("dusk_delay")].as<int>();
   }
 
   if (restore_on_power_loss) {
-    if (json_object.containsKey("light1")) {
-      light1 = json_object["light1"].as<bool>();
+    if (json_object.containsKey(F("light1"))) {
+      light1 = json_object[F("light1")].as<bool>();
     }
-    if (json_object.containsKey("light2")) {
-      light2 = json_object["light2"].as<bool>();
+    if (json_object.containsKey(F("light2"))) {
+      light2 = json_object[F("light2")].as<bool>();
     }
   }
 
-  if (json_object.containsKey("location")) {
-    geo_location = json_object["location"].as<String>();
+  if (json_object.containsKey(F("location")) && json_object[F("location")].as<String>().length() < sizeof(SettingsImage::location)) {
+    geo_location = json_object[F("location")].as<String>();
+  }
+  if (json_object.containsKey(F("sensors"))) {
+    also_sensors = json_object[F("sensors")].as<bool>();
   }
-  if (json_object.containsKey("sensors")) {
-    also_sensors = json_object["sensors"].as<bool>();
+  if (json_object.containsKey(F("window"))) {
+    outbound_window = constrain(json_object[F("window")].as<int>(), 0, outbound_window_limit);
   }
 
   saveSettings(false);
+  if (LittleFS.exists("/settings.bin")) {
+    LittleFS.remove("/settings.txt");
+    LittleFS.remove("/backup.txt");
+  }
 
   return true;
 }
 
+void readUprisings() {
+  int stored = uprisings - 1;
+  File file = LittleFS.open("/uprisings.bin", "r");
+  if (file) {
+    if (file.read((uint8_t*)&stored, sizeof(stored)) != sizeof(stored)) {
+      stored = uprisings - 1;
+    }
+    file.close();
+  }
+
+  uint32_t pending[2];
+  if (!ESP.rtcUserMemoryRead(uprisings_block, pending, sizeof(pending)) || pending[0] != uprisings_magic) {
+    pending[1] = 0;
+  }
+  pending[0] = uprisings_magic;
+  pending[1]++;
+  ESP.rtcUserMemoryWrite(uprisings_block, pending, sizeof(pending));
+
+  uprisings = stored + pending[1];
+}
+
+void saveUprisings() {
+  File file = LittleFS.open("/uprisings.bin", "r");
+  int stored = -1;
+  if (file) {
+    file.read((uint8_t*)&stored, sizeof(stored));
+    file.close();
+  }
+
+  if (stored != uprisings) {
+    file = LittleFS.open("/uprisings.bin", "w");
+    if (!file) {
+      return;
+    }
+    file.write((uint8_t*)&uprisings, sizeof(uprisings));
+    file.close();
+  }
+
+  uint32_t pending[2] = {uprisings_magic, 0};
+  ESP.rtcUserMemoryWrite(uprisings_block, pending, sizeof(pending));
+}
+
 void saveSettings() {
   saveSettings(true);
 }
 
 void saveSettings(bool log) {
-  DynamicJsonDocument json_object(1024);
-
-  json_object["ssid"] = ssid;
-  json_object["password"] = password;
+  Section section(SECTION_SETTINGS);
+  SettingsImage image;
+  memset(&image, 0, sizeof(image));
+
+  image.magic = settings_magic;
+  image.layout = settings_layout;
+  image.size = sizeof(image);
+
+  strncpy(image.ssid, ssid.c_str(), sizeof(image.ssid) - 1);
+  strncpy(image.password, password.c_str(), sizeof(image.password) - 1);
+  strncpy(image.location, geo_location.c_str(), sizeof(image.location) - 1);
+
+  image.offset = offset;
+  image.dst = dst;
+  image.restore = restore_on_power_loss;
+  image.dusk_delay = dusk_delay;
+  image.dawn_delay = dawn_delay;
+  image.sensors = also_sensors;
+  image.window = outbound_window;
+  image.light1 = light1;
+  image.light2 = light2;
+  image.smart_length = smart_string.length();
+
+  image.sync_clock = sync_clock;
+  image.sync_sequence = sync_sequence;
+  image.offset_stamp[0] = offset_stamp.lamport;
+  image.offset_stamp[1] = offset_stamp.sequence;
+  image.dst_stamp[0] = dst_stamp.lamport;
+  image.dst_stamp[1] = dst_stamp.sequence;
+  for (int i = 0; i < 8; i++) {
+    image.cursor_ip[i] = sync_cursors[i].ip;
+    image.cursor_sequence[i] = sync_cursors[i].sequence;
+    image.cursor_epoch[i] = sync_cursors[i].epoch;
+  }
 
-  json_object["smart"] = smart_string;
-  json_object["uprisings"] = uprisings;
-  json_object["offset"] = offset;
-  json_object["dst"] = dst;
-  json_object["restore"] = restore_on_power_loss;
-  json_object["dusk_delay"] = dusk_delay;
-  json_object["dawn_delay"] = dawn_delay;
-  json_object["location"] = geo_location;
-  json_object["sensors"] = also_sensors;
+  memcpy(image.bssid, wifi_bssid, 6);
+  image.channel = wifi_channel;
+  image.ip = wifi_ip;
+  image.gateway = wifi_gateway;
+  image.subnet = wifi_subnet;
+  image.dns = wifi_dns;
+  image.lease_boot = wifi_lease_boot;
 
-  json_object["light1"] = light1;
-  json_object["light2"] = light2;
+  uint32_t crc = crc32(&image, sizeof(image));
+  crc = crc32(smart_string.c_str(), image.smart_length, crc);
 
-  if (writeObjectToFile("settings", json_object)) {
+  if (writeSettingsImage("/settings.bin", image, crc)) {
     if (log) {
-      String logs;
-      serializeJson(json_object, logs);
-      note("Saving settings:\n " + logs);
+      NOTE_INFO(String(F("Saving settings:\n ")) + smart_string + F(" / ") + getValue());
     }
 
-    writeObjectToFile("backup", json_object);
+    writeSettingsImage("/backup.bin", image, crc);
+    saveRelayRecord();
   } else {
-    note("Saving the settings failed!");
+    NOTE_ERROR(F("Saving the settings failed!"));
   }
 }
 
+bool writeSettingsImage(const char* name, SettingsImage& image, uint32_t crc) {
+  File file = LittleFS.open(name, "w");
+  if (!file) {
+    return false;
+  }
+
+  bool result = file.write((uint8_t*)&image, sizeof(image)) == sizeof(image)
+  && file.write((const uint8_t*)smart_string.c_str(), image.smart_length) == image.smart_length
+  && file.write((uint8_t*)&crc, 4) == 4;
+  file.close();
+
+  return result;
+}
+
 
 void sayHelloToTheServer() {
   // This function is only available with a ready-made iDom device.
@@ -161,24 +384,42 @@ void introductionToServer() {
   // This function is only available with a ready-made iDom device.
 }
 
+void onRoute(const __FlashStringHelper* uri, WebRequestMethod method, ArRequestHandlerFunction handler, ArBodyHandlerFunction body) {
+  server.on(String(uri).c_str(), method, handler, NULL, body);
+}
+
 void startServices() {
-  server.on("/hello", HTTP_POST, handshake);
-  server.on("/set", HTTP_PUT, receivedOfflineData);
-  server.on("/state", HTTP_GET, requestForState);
-  server.on("/basicdata", HTTP_POST, exchangeOfBasicData);
-  server.on("/log", HTTP_GET, requestForLogs);
-  server.on("/log", HTTP_DELETE, clearTheLog);
-  server.on("/admin/update", HTTP_POST, manualUpdate);
-  server.on("/admin/log", HTTP_POST, activationTheLog);
-  server.on("/admin/log", HTTP_DELETE, deactivationTheLog);
+  onRoute(F("/hello"), HTTP_POST, handshake, receiveBody);
+  onRoute(F("/set"), HTTP_PUT, receivedOfflineData, receiveBody);
+  onRoute(F("/state"), HTTP_GET, requestForState, NULL);
+  onRoute(F("/basicdata"), HTTP_POST, exchangeOfBasicData, receiveBody);
+  onRoute(F("/stats"), HTTP_GET, requestForStats, NULL);
+  onRoute(F("/admin/serial"), HTTP_POST, activationSerialLog, NULL);
+  onRoute(F("/admin/serial"), HTTP_DELETE, deactivationSerialLog, NULL);
+#if FEATURE_LOG
+  onRoute(F("/log"), HTTP_GET, requestForLogs, NULL);
+  onRoute(F("/log"), HTTP_DELETE, clearTheLog, NULL);
+  onRoute(F("/admin/log"), HTTP_POST, activationTheLog, NULL);
+  onRoute(F("/admin/log"), HTTP_DELETE, deactivationTheLog, NULL);
+#endif
+#if FEATURE_ONLINE
+  onRoute(F("/admin/update"), HTTP_POST, requestForUpdate, NULL);
+#endif
+#ifdef SIMULATOR
+  onRoute(F("/admin/simulation"), HTTP_POST, requestForSimulation, receiveBody);
+  onRoute(F("/admin/simulation"), HTTP_GET, requestForSimulationResult, NULL);
+#endif
   server.begin();
 
-  note(String(host_name) + (MDNS.begin(host_name) ? " started" : " unsuccessful!"));
+  NOTE_INFO(String(host_name) + (MDNS.begin(host_name) ? F(" started") : F(" unsuccessful!")));
 
   MDNS.addService("idom", "tcp", 8080);
 
+#if FEATURE_ONLINE
   getTime();
+#endif
   getOfflineData();
+  markBootPhase(BOOT_SERVICES);
 }
 
 String getSwitchDetail() {
@@ -194,64 +435,170 @@ String getValue() {
   return String(light1 ? "1" : "") + (light2 ? "2" : "");
 }
 
-void handshake() {
-  if (server.hasArg("plain")) {
-    readData(server.arg("plain"), true);
+void handshake(AsyncWebServerRequest *request) {
+  uint32_t start = micros();
+
+  if (!admitRequest(request) || isBodyTooLarge(request)) {
+    return;
   }
 
-  String reply = "\"id\":\"" + WiFi.macAddress()
-  + "\",\"value\":" + getValue()
-  + ",\"twilight\":" + twilight
-  + ",\"cloudiness\":" + cloudiness
-  + ",\"next_sunset\":" + next_sunset
-  + ",\"next_sunrise\":" + next_sunrise
-  + ",\"sun_check\":" + last_sun_check
-  + ",\"restore\":" + restore_on_power_loss
-  + ",\"dusk_delay\":" + dusk_delay
-  + ",\"dawn_delay\":" + dawn_delay
-  + ",\"location\":\"" + geo_location
-  + "\",\"sensors\":" + also_sensors
-  + ",\"version\":" + version
-  + ",\"smart\":\"" + smart_string
-  + "\",\"rtc\":" + RTCisrunning()
-  + ",\"dst\":" + dst
-  + ",\"offset\":" + offset
-  + ",\"time\":" + (RTCisrunning() ? String(RTC.now().unixtime() - offset - (dst ? 3600 : 0)) : "0")
-  + ",\"active\":" + String(start_time > 0 ? RTC.now().unixtime() - offset - (dst ? 3600 : 0) - start_time : 0)
-  + ",\"uprisings\":" + uprisings
-  + ",\"offline\":" + offline;
+  if (hasBody(request)) {
+    if (!isValidData(getBody(request)) || !queueData(request)) {
+      request_errors++;
+    }
+  } else if (isNotModified(request)) {
+    addToHistogram(hello_latency, micros() - start);
+    return;
+  }
 
-  Serial.print("\nHandshake");
-  server.send(200, "text/plain", "{" + reply + "}");
+  String reply = String(F("\"id\":\"")) + WiFi.macAddress()
+  + F("\",\"value\":") + getValue()
+  + F(",\"twilight\":") + twilight
+  + F(",\"cloudiness\":") + cloudiness
+  + F(",\"next_sunset\":") + next_sunset
+  + F(",\"next_sunrise\":") + next_sunrise
+  + F(",\"sun_check\":") + last_sun_check
+  + F(",\"restore\":") + restore_on_power_loss
+  + F(",\"dusk_delay\":") + dusk_delay
+  + F(",\"dawn_delay\":") + dawn_delay
+  + F(",\"location\":\"") + geo_location
+  + F("\",\"sensors\":") + also_sensors
+  + F(",\"version\":") + version
+  + F(",\"smart\":\"") + smart_string
+  + F("\",\"rtc\":") + RTCisrunning()
+  + F(",\"dst\":") + dst
+  + F(",\"offset\":") + offset
+  + F(",\"time\":") + (RTCisrunning() ? String(RTC.now().unixtime() - offset - (dst ? 3600 : 0)) : String(0))
+  + F(",\"active\":") + String(start_time > 0 ? RTC.now().unixtime() - offset - (dst ? 3600 : 0) - start_time : 0)
+  + F(",\"uprisings\":") + uprisings
+  + F(",\"boot\":") + getBootPhases()
+  + F(",\"wifi_time\":") + wifi_connect_time
+  + F(",\"duty\":") + duty_cycle
+  + F(",\"wake_latency\":") + wake_latency
+  + F(",\"offline\":") + offline
+  + F(",\"window\":") + outbound_window
+  + F(",\"merged\":") + outbound_merged
+  + F(",\"postmortem\":\"") + postmortem
+  + F("\",\"stall\":\"") + last_stall + F("\"");
+
+  printSerial(F("\nHandshake"));
+  sendWithETag(request, "{" + reply + F("}"));
+
+  addToHistogram(hello_latency, micros() - start);
 }
 
-void requestForState() {
-  String reply = "\"state\":" + getValue();
+void requestForState(AsyncWebServerRequest *request) {
+  uint32_t start = micros();
 
-  server.send(200, "text/plain", "{" + reply + "}");
+  if (isNotModified(request)) {
+    addToHistogram(state_latency, micros() - start);
+    return;
+  }
+
+  String reply = String(F("\"state\":")) + getValue();
+
+  sendWithETag(request, "{" + reply + F("}"));
+
+  addToHistogram(state_latency, micros() - start);
 }
 
-void exchangeOfBasicData() {
-  if (server.hasArg("plain")) {
-    readData(server.arg("plain"), true);
+void exchangeOfBasicData(AsyncWebServerRequest *request) {
+  uint32_t since = 0;
+  uint32_t epoch = 0;
+
+  if (isBodyTooLarge(request)) {
+    return;
   }
 
-  String reply = "\"offset\":" + String(offset) + ",\"dst\":" + String(dst);
+  if (hasBody(request)) {
+    ArenaJsonDocument json_object(256);
+    deserializeJson(json_object, getBody(request));
+    since = json_object[F("since")].as<uint32_t>();
+    epoch = json_object[F("epoch")].as<uint32_t>();
+
+    // Peers only send their id and cursor, anything else is data for readData().
+    if (json_object.size() > (size_t)json_object.containsKey(F("id")) + json_object.containsKey(F("since")) + json_object.containsKey(F("epoch"))) {
+      queueData(request);
+    }
+  }
+  if (since > sync_sequence || epoch != state_epoch) {
+    since = 0;
+  }
+
+  String reply = String(F("\"seq\":")) + String(sync_sequence) + F(",\"epoch\":") + String(state_epoch);
+
+  if (isChanged(offset_stamp, since)) {
+    reply += String(F(",\"offset\":")) + String(offset) + F(",\"offset_stamp\":") + String(offset_stamp.lamport);
+  }
+  if (isChanged(dst_stamp, since)) {
+    reply += String(F(",\"dst\":")) + String(dst) + F(",\"dst_stamp\":") + String(dst_stamp.lamport);
+  }
+
+  if (isChanged(twilight_stamp, since) && twilight_stamp.lamport != 0) {
+    reply += String(F(",\"twilight\":")) + String(twilight) + F(",\"twilight_stamp\":") + String(twilight_stamp.lamport);
+  }
 
   if (RTCisrunning()) {
-    reply += ",\"time\":" + String(RTC.now().unixtime() - offset - (dst ? 3600 : 0));
+    reply += String(F(",\"time\":")) + String(RTC.now().unixtime() - offset - (dst ? 3600 : 0)) + F(",\"time_stamp\":") + String(time_stamp.lamport);
   }
 
-  server.send(200, "text/plain", "{" + reply + "}");
+  request->send(200, F("text/plain"), "{" + reply + F("}"));
+}
+
+
+void requestForStats(AsyncWebServerRequest *request) {
+  String reply = String(F("\"sent\":")) + String(messages_sent)
+  + F(",\"failed\":") + messages_failed
+  + F(",\"received\":") + messages_received
+  + F(",\"discoveries\":") + discoveries
+  + F(",\"peers\":") + countDevices()
+  + F(",\"handler_time\":") + (uint32_t)(handler_time / 1000)
+  + F(",\"awake_time\":") + (millis() - total_sleep_time)
+  + F(",\"uptime\":") + millis()
+  + F(",\"errors\":") + request_errors
+  + F(",\"serial_dropped\":") + serial_dropped
+  + F(",\"light_suppressed\":") + light_suppressed
+  + F(",\"stalls\":") + stalls
+  + F(",\"throttled\":") + requests_throttled
+  + F(",\"overloaded\":") + requests_overloaded
+  + F(",\"not_modified\":") + not_modified
+  + F(",\"heap\":") + ESP.getFreeHeap()
+  + F(",\"max_block\":") + ESP.getMaxFreeBlockSize()
+  + F(",\"fragmentation\":") + ESP.getHeapFragmentation()
+  + F(",\"arena_peak\":") + arena_peak
+  + F(",\"arena_overflows\":") + arena_overflows
+  + F(",\"arena_leaks\":") + arena_leaks
+  + F(",\"hello\":") + getHistogram(hello_latency)
+  + F(",\"set\":") + getHistogram(set_latency)
+  + F(",\"state\":") + getHistogram(state_latency)
+  + F(",\"loop\":") + getHistogram(loop_latency)
+  + F(",\"press\":") + getHistogram(press_latency)
+  + F(",\"send\":") + getHistogram(send_latency)
+  + F(",\"hop\":") + getHistogram(hop_latency)
+  + F(",\"relay\":") + getHistogram(relay_jitter)
+  + F(",\"hops\":") + getRecentHops();
+#if FEATURE_ONLINE
+  reply += String(F(",\"stored\":")) + outbox_stored + F(",\"replayed\":") + outbox_replayed;
+#endif
+
+  request->send(200, F("text/plain"), "{" + reply + F("}"));
 }
 
 
+void IRAM_ATTR buttonEdge() {
+  button_edge = true;
+  button_edge_time = micros();
+  esp_schedule();
+}
+
 void button1Single(void* s) {
+  startTrace();
   light1 = !light1;
   setLights("manual", true);
 }
 
 void button2Single(void* s) {
+  startTrace();
   light2 = !light2;
   setLights("manual", true);
 }
@@ -259,32 +606,287 @@ void button2Single(void* s) {
 
 
 void loop() {
+  waitForNextEvent();
+  Section section(SECTION_LOOP);
+
+  if (relay_fired) {
+    relay_fired = false;
+    addToHistogram(relay_jitter, abs(relay_late));
+
+    // The interrupt switched the relays from the rules armed a second earlier, the state follows them even if twilight changed meanwhile.
+    for (int j = 0; j < 2; j++) {
+      bool& light = j == 0 ? light1 : light2;
+      if (relay_set_mask & (1 << relay_pin[j])) {
+        light = true;
+      }
+      if (relay_clear_mask & (1 << relay_pin[j])) {
+        light = false;
+      }
+    }
+    setLights("smart", true);
+  }
+
   if (WiFi.status() == WL_CONNECTED) {
     digitalWrite(led_pin, LOW);
   } else {
     digitalWrite(led_pin, loop_time % 2 == 0);
+#if FEATURE_ONLINE
     if (!sending_error) {
-      note("Wi-Fi connection lost");
+      NOTE_ERROR(F("Wi-Fi connection lost"));
     }
     sending_error = true;
+#endif
   }
 
+  flushSerial();
+
+#if FEATURE_OTA
+  PROGRESS();
   ArduinoOTA.handle();
-  server.handleClient();
+#endif
+  PROGRESS();
+  runDeferredTasks();
+  PROGRESS();
+  flushOutbound(false);
+  PROGRESS();
   MDNS.update();
 
+  PROGRESS();
   button1.poll();
   button2.poll();
 
-  if (hasTimeChanged()) {
+  hasTimeChanged();
+  if (!uprisings_saved && millis() > uprisings_delay) {
+    uprisings_saved = deferTask(TASK_SAVE_UPRISINGS);
+  }
+  PROGRESS();
+  renewLease();
+
+  if ((int32_t)(millis() - next_event) >= 0 || schedule_version != state_version) {
+#if FEATURE_ONLINE
+    PROGRESS();
     getOnlineData();
-    if (twilight_counter > 0) {
-      if (--twilight_counter == 0) {
+#endif
+    PROGRESS();
+    if (loop_time % 60 == 0) {
+      aggregateLight();
+    }
+    armSchedule();
+    PROGRESS();
+    if (twilight_counter > 0 && schedule_time != 0) {
+      twilight_counter -= constrain((int32_t)(loop_time - schedule_time), 0, twilight_counter);
+      if (twilight_counter == 0) {
         automaticSettings(true);
-        return;
+      } else {
+        automaticSettings();
       }
+    } else {
+      automaticSettings();
+    }
+
+    schedule_time = loop_time;
+    schedule_version = state_version;
+    next_event = RTCisrunning() ? RTC.millisAt(nextEventTime()) : nextEventTime() * 1000;
+  }
+}
+
+void runDeferredTasks() {
+  while (task_count > 0) {
+    byte task = tasks[task_head];
+    task_head = (task_head + 1) % 8;
+    task_count--;
+
+    switch (task) {
+      case TASK_SAVE_SETTINGS:
+        saveSettings();
+        break;
+#if FEATURE_GEO
+      case TASK_SUN_CHECK:
+        getSunriseSunset(RTC.now().day());
+        break;
+#endif
+      case TASK_SAVE_UPRISINGS:
+        saveUprisings();
+        break;
+      case TASK_READ_DATA:
+        readReceivedData();
+        break;
+#ifdef SIMULATOR
+      case TASK_SIMULATION:
+        runSimulation();
+        break;
+#endif
+    }
+  }
+}
+
+void flushOutbound(bool force) {
+  String data = takeOutbound(force);
+
+#if FEATURE_ONLINE
+  if (!offline && (WiFi.status() != WL_CONNECTED || outbox_pending)) {
+    storeOutbox(data);
+    replayOutbox();
+    return;
+  }
+
+  if (data.length() > 0) {
+    putOnlineData(data);
+    if (trace_start != 0 && strContains(data, F("trace="))) {
+      addToHistogram(send_latency, micros() - trace_start);
+      trace_start = 0;
+    }
+  }
+#endif
+}
+
+#if FEATURE_ONLINE
+void requestForUpdate(AsyncWebServerRequest *request) {
+  // The update restarts the device and the handler cannot wait for the cloud, the notifications wait in the outbox instead.
+  if (!offline) {
+    storeOutbox(takeOutbound(true));
+  }
+  manualUpdate(request);
+}
+
+void replayOutbox() {
+  if (!outbox_pending || WiFi.status() != WL_CONNECTED || (outbox_retry > 0 && millis() - outbox_retry < outbox_retry_interval)) {
+    return;
+  }
+
+  // putOnlineData() only ever sets sending_error on a failed send, the flag is cleared first so it reports this one.
+  String data = readOutbox();
+  if (data.length() > 0) {
+    sending_error = false;
+    putOnlineData(data);
+    if (sending_error) {
+      outbox_retry = millis() | 1;
+      return;
+    }
+  }
+
+  LittleFS.remove("/outbox.txt");
+  outbox_pending = false;
+  outbox_retry = 0;
+  outbox_replayed++;
+  NOTE_INFO(String(F("Outbox replayed: ")) + data);
+}
+#endif
+
+uint32_t nextDeadline() {
+  uint32_t now = millis();
+
+  if (task_count > 0 || (int32_t)(button_awake_until - now) > 0 || digitalRead(button_pin[0]) == LOW || digitalRead(button_pin[1]) == LOW) {
+    return now;
+  }
+
+  uint32_t deadline = now + service_interval;
+  if ((int32_t)(next_event - deadline) < 0) {
+    deadline = next_event;
+  }
+  if (outbound_since != 0 && (int32_t)(outbound_since + outbound_window - deadline) < 0) {
+    deadline = outbound_since + outbound_window;
+  }
+  if (serial_head != serial_tail && (int32_t)(now + 10 - deadline) < 0) {
+    deadline = now + 10;
+  }
+  return deadline;
+}
+
+uint32_t nextEventTime() {
+  if (!RTCisrunning()) {
+    return millis() / 1000 + 1;
+  }
+
+  uint32_t now = RTC.now().unixtime();
+  uint32_t due = now + 86400;
+
+  // The blinking LED and the online mode need every second, the rest only happens at known minutes.
+  if (WiFi.status() != WL_CONNECTED || !offline) {
+    return now + 1;
+  }
+  if (twilight_counter > 0) {
+    due = now + twilight_counter;
+  }
+
+  for (int i = 0; i < 8; i++) {
+    if (light_samples[i].time != 0 && loop_time - light_samples[i].time <= light_window) {
+      due = min(due, now - now % 60 + 60);
+    }
+  }
+#if FEATURE_GEO
+  if (geo_location.length() >= 2 && (next_sunset == -1 || next_sunrise == -1 || (last_sun_check != RTC.now().day() && now % 86400 >= 52 * 60))) {
+    due = min(due, now - now % 60 + 60);
+  }
+  if (geo_location.length() >= 2 && last_sun_check != RTC.now().day()) {
+    addEventMinute(due, now, 52, 0);
+  }
+#endif
+  addEventMinute(due, now, next_sunset, 0);
+  addEventMinute(due, now, next_sunrise, 0);
+  addEventMinute(due, now, 120, 0);
+  addEventMinute(due, now, 180, 0);
+#if FEATURE_ONLINE
+  addEventMinute(due, now, 61, 0);
+#endif
+
+  for (int i = 0; i < smart_count; i++) {
+    if (smart_array[i].enabled) {
+      addEventMinute(due, now, smart_array[i].on_time, -1);
+      addEventMinute(due, now, smart_array[i].on_time, 0);
+      addEventMinute(due, now, smart_array[i].off_time, -1);
+      addEventMinute(due, now, smart_array[i].off_time, 0);
+    }
+  }
+  return due;
+}
+
+void addEventMinute(uint32_t& due, uint32_t now, int minute, int second) {
+  if (minute < 0) {
+    return;
+  }
+
+  uint32_t time = now - now % 86400 + minute * 60 + second;
+  if ((int32_t)(time - now) <= 0) {
+    time += 86400;
+  }
+  if ((int32_t)(time - now) > 0 && time < due) {
+    due = time;
+  }
+}
+
+void waitForNextEvent() {
+  if (button_edge) {
+    button_edge = false;
+    button_awake_until = millis() + 100;
+  }
+
+  if (loop_wake != 0) {
+    addToHistogram(loop_latency, micros() - loop_wake);
+  }
+
+  uint32_t now = millis();
+  int32_t idle = nextDeadline() - now;
+
+  if (idle > 0) {
+    uint32_t deadline_us = micros() + idle * 1000;
+    delay(idle);
+    idle_sleep_time += millis() - now;
+    total_sleep_time += millis() - now;
+
+    int32_t late = micros() - deadline_us;
+    if (late > 0 && !button_edge && (uint32_t)late > wake_latency) {
+      wake_latency = late;
     }
-    automaticSettings();
+  }
+
+  loop_wake = micros();
+
+  if (millis() - idle_window_start >= 60000) {
+    duty_cycle = 100 - (idle_sleep_time * 100 / (millis() - idle_window_start));
+    idle_window_start = millis();
+    idle_sleep_time = 0;
+    wake_latency = 0;
   }
 }
 
@@ -298,9 +900,11 @@ bool hasTheLightChanged() {
   int current_time = (now.hour() * 60) + now.minute();
   bool result = false;
 
+#if FEATURE_GEO
   if ((current_time > 51 && last_sun_check != now.day()) || next_sunset == -1 || next_sunrise == -1) {
     getSunriseSunset(now.day());
   }
+#endif
 
   if (next_sunset > -1 && next_sunrise > -1) {
     if (current_time == next_sunset && !twilight) {
@@ -313,58 +917,90 @@ bool hasTheLightChanged() {
     }
   }
 
+  if (result) {
+    state_version++;
+    takeStamp(twilight_stamp, 0, false, false);
+  }
+
   return result;
 }
 
 void readData(String payload, bool per_wifi) {
-  DynamicJsonDocument json_object(1024);
+  readData(payload, per_wifi, false);
+}
+
+void readData(String payload, bool per_wifi, bool peer) {
+#ifdef SIMULATOR
+  if (simulation) {
+    return;
+  }
+#endif
+
+  uint32_t start = micros();
+  if (per_wifi) {
+    messages_received++;
+  }
+
+  ArenaJsonDocument json_object(1024);
   deserializeJson(json_object, payload);
 
   if (json_object.isNull()) {
     if (payload.length() > 0) {
-      note("Parsing failed!");
+      NOTE_ERROR(F("Parsing failed!"));
     }
     return;
   }
 
+  String trace = json_object.containsKey(F("trace")) ? json_object[F("trace")].as<String>() : "";
+  if (trace.length() > 0) {
+    recordHop(trace);
+  }
+
   bool settings_change = false;
   bool details_change = false;
   String result = "";
 
-  if (json_object.containsKey("offset")) {
-    if (offset != json_object["offset"].as<int>()) {
-      if (RTCisrunning() && !json_object.containsKey("time")) {
-        RTC.adjust(DateTime((RTC.now().unixtime() - offset) + json_object["offset"].as<int>()));
-        note("Time zone change");
+  if (json_object.containsKey(F("offset"))) {
+    int new_offset = json_object[F("offset")].as<int>();
+    if (offset != new_offset && takeStamp(offset_stamp, json_object[F("offset_stamp")].as<uint32_t>(), peer, new_offset > offset)) {
+      if (RTCisrunning() && !json_object.containsKey(F("time"))) {
+        RTC.adjust(DateTime((RTC.now().unixtime() - offset) + json_object[F("offset")].as<int>()));
+        NOTE_INFO(F("Time zone change"));
       }
 
-      offset = json_object["offset"].as<int>();
+      offset = json_object[F("offset")].as<int>();
       settings_change = true;
     }
   }
 
-  if (json_object.containsKey("dst")) {
-    if (dst != strContains(json_object["dst"].as<String>(), "1")) {
+  if (json_object.containsKey(F("dst"))) {
+    if (dst != strContains(json_object[F("dst")].as<String>(), "1") && takeStamp(dst_stamp, json_object[F("dst_stamp")].as<uint32_t>(), peer, !dst)) {
       dst = !dst;
       settings_change = true;
 
-      if (RTCisrunning() && !json_object.containsKey("time")) {
+      if (RTCisrunning() && !json_object.containsKey(F("time"))) {
         RTC.adjust(DateTime(RTC.now().unixtime() + (dst ? 3600 : -3600)));
-        note(dst ? "Summer time" : "Winter time");
+        NOTE_INFO(dst ? F("Summer time") : F("Winter time"));
       }
     }
   }
 
-  if (json_object.containsKey("time")) {
-    uint32_t new_time = json_object["time"].as<uint32_t>() + offset + (dst ? 3600 : 0);
+  if (json_object.containsKey(F("time"))) {
+    uint32_t new_time = json_object[F("time")].as<uint32_t>() + offset + (dst ? 3600 : 0);
+    uint32_t remote = json_object[F("time_stamp")].as<uint32_t>();
     if (new_time > 1546304461) {
       if (RTCisrunning()) {
-        if (abs(new_time - RTC.now().unixtime()) > 60) {
+        if (abs(new_time - RTC.now().unixtime()) > 60 && takeStamp(time_stamp, remote, peer, false)) {
           RTC.adjust(DateTime(new_time));
+          state_version++;
         }
       } else {
+        // Any time is better than none, an unstamped one stays older than the clock of every peer.
+        time_stamp.lamport = 0;
+        takeStamp(time_stamp, remote, peer, false);
         RTC.adjust(DateTime(new_time));
-        note("Adjust time");
+        state_version++;
+        NOTE_INFO(F("Adjust time"));
         start_time = RTC.now().unixtime() - offset - (dst ? 3600 : 0);
         if (RTCisrunning() && !offline) {
           details_change = true;
@@ -373,42 +1009,63 @@ void readData(String payload, bool per_wifi) {
     }
   }
 
-  if (json_object.containsKey("smart")) {
-    if (smart_string != json_object["smart"].as<String>()) {
-      smart_string = json_object["smart"].as<String>();
+  if (json_object.containsKey(F("smart"))) {
+    if (smart_string != json_object[F("smart")].as<String>()) {
+      smart_string = json_object[F("smart")].as<String>();
       setSmart();
       if (per_wifi) {
-        result += String(result.length() > 0 ? "&" : "") + "smart=" + getSmartString();
+        result += String(result.length() > 0 ? "&" : "") + F("smart=") + getSmartString();
       }
       settings_change = true;
     }
   }
 
-  if (json_object.containsKey("val")) {
-    String newValue = json_object["val"].as<String>();
+  if (json_object.containsKey(F("val"))) {
+    String newValue = json_object[F("val")].as<String>();
     if (getValue() != newValue) {
       light1 = strContains(newValue, "1") || strContains(newValue, "4");
       light2 = strContains(newValue, "2") || strContains(newValue, "4");
-      setLights(per_wifi ? (json_object.containsKey("apk") ? "apk" : "local") : "cloud", false);
+      setLights(per_wifi ? (json_object.containsKey(F("apk")) ? "apk" : "local") : "cloud", false);
       if (per_wifi) {
-        result += String(result.length() > 0 ? "&" : "") + "val=" + getValue();
+        result += String(result.length() > 0 ? "&" : "") + F("val=") + getValue();
       }
     }
   }
 
-  if (json_object.containsKey("restore")) {
-    if (restore_on_power_loss != strContains(json_object["restore"].as<String>(), "1")) {
+  if (json_object.containsKey(F("restore"))) {
+    if (restore_on_power_loss != strContains(json_object[F("restore")].as<String>(), "1")) {
       restore_on_power_loss = !restore_on_power_loss;
       details_change = true;
     }
   }
 
-  if (json_object.containsKey("dusk_delay")) {
-    if (dusk_delay != json_object["dusk_delay"].as<int>()) {
+  if (json_object.containsKey(F("devices"))) {
+    if (isDeviceList(json_object[F("devices")].as<String>())) {
+      if (devices != json_object[F("devices")].as<String>()) {
+        devices = json_object[F("devices")].as<String>();
+        state_version++;
+      }
+      static_devices = devices.length() > 0;
+      last_discovery = 0;
+    } else {
+      NOTE_ERROR(F("Invalid list of devices"));
+    }
+  }
+
+  if (json_object.containsKey(F("window"))) {
+    int window = constrain(json_object[F("window")].as<int>(), 0, outbound_window_limit);
+    if (outbound_window != window) {
+      outbound_window = window;
+      details_change = true;
+    }
+  }
+
+  if (json_object.containsKey(F("dusk_delay"))) {
+    if (dusk_delay != json_object[F("dusk_delay")].as<int>()) {
       if (next_sunset != -1) {
         next_sunset -= dusk_delay;
       }
-      dusk_delay = json_object["dusk_delay"].as<int>();
+      dusk_delay = json_object[F("dusk_delay")].as<int>();
       if (next_sunset != -1) {
         next_sunset += dusk_delay;
       }
@@ -416,12 +1073,12 @@ void readData(String payload, bool per_wifi) {
     }
   }
 
-  if (json_object.containsKey("dawn_delay")) {
-    if (dawn_delay != json_object["dawn_delay"].as<int>()) {
+  if (json_object.containsKey(F("dawn_delay"))) {
+    if (dawn_delay != json_object[F("dawn_delay")].as<int>()) {
       if (next_sunrise != -1) {
         next_sunrise -= dawn_delay;
       }
-      dawn_delay = json_object["dawn_delay"].as<int>();
+      dawn_delay = json_object[F("dawn_delay")].as<int>();
       if (next_sunset != -1) {
         next_sunrise += dawn_delay;
       }
@@ -429,51 +1086,109 @@ void readData(String payload, bool per_wifi) {
     }
   }
 
-  if (json_object.containsKey("location")) {
-    if (geo_location != json_object["location"].as<String>()) {
-      geo_location = json_object["location"].as<String>();
-      getSunriseSunset(RTC.now().day());
+  if (json_object.containsKey(F("location"))) {
+    if (json_object[F("location")].as<String>().length() >= sizeof(SettingsImage::location)) {
+      NOTE_ERROR(F("Location too long"));
+    } else if (geo_location != json_object[F("location")].as<String>()) {
+      geo_location = json_object[F("location")].as<String>();
+      deferTask(TASK_SUN_CHECK);
       details_change = true;
     }
   }
 
-  if (json_object.containsKey("sensors")) {
-    if (also_sensors != strContains(json_object["sensors"].as<String>(), "1")) {
+  if (json_object.containsKey(F("sensors"))) {
+    if (also_sensors != strContains(json_object[F("sensors")].as<String>(), "1")) {
       also_sensors = !also_sensors;
       details_change = true;
     }
   }
 
-  if (json_object.containsKey("light")) {
-    if (((geo_location.length() < 2 || also_sensors) && twilight != strContains(json_object["light"].as<String>(), "t"))
-    || (geo_location.length() > 2 && !also_sensors && cloudiness != strContains(json_object["light"].as<String>(), "t"))) {
-      if (geo_location.length() < 2) {
-        twilight = !twilight;
-      } else {
-        if (also_sensors) {
-          twilight = !twilight;
-        } else {
-          cloudiness = !cloudiness;
-        }
-      }
+  if (json_object.containsKey(F("light"))) {
+    receivedLight(strContains(json_object[F("light")].as<String>(), "t"));
+  }
 
-      if (twilight && dusk_delay != 0) {
-        twilight_counter = (dusk_delay * (dusk_delay < 0 ? -1 : 1)) * 60;
-      } else {
-          automaticSettings(true);
-      }
+  if (json_object.containsKey(F("twilight"))) {
+    bool dark = strContains(json_object[F("twilight")].as<String>(), "1");
+    if ((geo_location.length() < 2 || also_sensors) && twilight != dark
+    && takeStamp(twilight_stamp, json_object[F("twilight_stamp")].as<uint32_t>(), peer, dark)) {
+      changeLight(dark);
     }
   }
 
   if (settings_change || details_change) {
-    note("Received the data:\n " + payload);
-    saveSettings();
+    NOTE_DEBUG(String(F("Received the data:\n ")) + payload);
+    deferTask(TASK_SAVE_SETTINGS);
   }
   if (!offline && (result.length() > 0 || details_change)) {
     if (details_change) {
-      result += String(result.length() > 0 ? "&" : "") + "detail=" + getSwitchDetail();
+      result += String(result.length() > 0 ? "&" : "") + F("detail=") + getSwitchDetail();
+    }
+    if (trace.length() > 0) {
+      result += String(F("&trace=")) + trace;
+    }
+    queueOutbound(result);
+  }
+
+  handler_time += micros() - start;
+}
+
+void receivedLight(bool dark) {
+  light_samples[light_head] = {loop_time | 1, dark};
+  light_head = (light_head + 1) % 8;
+
+  aggregateLight();
+  if (isDark() != dark) {
+    light_suppressed++;
+  }
+}
+
+bool isDark() {
+  return geo_location.length() < 2 || also_sensors ? twilight : cloudiness;
+}
+
+void aggregateLight() {
+  int count = 0;
+  int dark = 0;
+  for (int i = 0; i < 8; i++) {
+    if (light_samples[i].time != 0 && loop_time - light_samples[i].time <= light_window) {
+      count++;
+      dark += light_samples[i].dark;
+    }
+  }
+
+  bool current = isDark();
+  int against = current ? count - dark : dark;
+  if (count == 0 || against * 3 < count * 2 || (light_changed != 0 && loop_time - light_changed < light_dwell)) {
+    return;
+  }
+
+  light_changed = loop_time;
+  bool was_twilight = twilight;
+  changeLight(!current);
+  if (twilight != was_twilight) {
+    takeStamp(twilight_stamp, 0, false, false);
+  }
+}
+
+void changeLight(bool dark) {
+  if (((geo_location.length() < 2 || also_sensors) && twilight != dark)
+  || (geo_location.length() > 2 && !also_sensors && cloudiness != dark)) {
+    state_version++;
+    if (geo_location.length() < 2) {
+      twilight = !twilight;
+    } else {
+      if (also_sensors) {
+        twilight = !twilight;
+      } else {
+        cloudiness = !cloudiness;
+      }
+    }
+
+    if (twilight && dusk_delay != 0) {
+      twilight_counter = (dusk_delay * (dusk_delay < 0 ? -1 : 1)) * 60;
+    } else {
+        automaticSettings(true);
     }
-    putOnlineData(result);
   }
 }
 
@@ -559,7 +1274,7 @@ void setSmart() {
       smart_count++;
     }
   }
-  note("Smart contains " + String(smart_count) + " of " + String(smart_prefix));
+  NOTE_DEBUG(String(F("Smart contains ")) + String(smart_count) + F(" of ") + String(smart_prefix));
 }
 
 bool automaticSettings() {
@@ -569,39 +1284,48 @@ bool automaticSettings() {
 bool automaticSettings(bool light_changed) {
   bool result = false;
   DateTime now = RTC.now();
-  String log = "Smart ";
+  String log = F("Smart ");
   int current_time = -1;
 
   if (RTCisrunning()) {
     current_time = (now.hour() * 60) + now.minute();
 
     if (current_time == 120 || current_time == 180) {
-      if (now.month() == 3 && now.day() > 24 && days_of_the_week[now.dayOfTheWeek()][0] == 's' && current_time == 120 && !dst) {
+      if (now.month() == 3 && now.day() > 24 && getDayOfTheWeek(now.dayOfTheWeek()) == 's' && current_time == 120 && !dst) {
         int new_time = now.unixtime() + 3600;
         RTC.adjust(DateTime(new_time));
         dst = true;
-        note("Smart set to summer time");
-        saveSettings();
-        getSunriseSunset(now.day());
+        takeStamp(dst_stamp, 0, false, false);
+        NOTE_INFO(F("Smart set to summer time"));
+        deferTask(TASK_SAVE_SETTINGS);
+        deferTask(TASK_SUN_CHECK);
       }
-      if (now.month() == 10 && now.day() > 24 && days_of_the_week[now.dayOfTheWeek()][0] == 's' && current_time == 180 && dst) {
+      if (now.month() == 10 && now.day() > 24 && getDayOfTheWeek(now.dayOfTheWeek()) == 's' && current_time == 180 && dst) {
         int new_time = now.unixtime() - 3600;
         RTC.adjust(DateTime(new_time));
         dst = false;
-        note("Smart set to winter time");
-        saveSettings();
-        getSunriseSunset(now.day());
+        takeStamp(dst_stamp, 0, false, false);
+        NOTE_INFO(F("Smart set to winter time"));
+        deferTask(TASK_SAVE_SETTINGS);
+        deferTask(TASK_SUN_CHECK);
       }
     }
 
+#if FEATURE_ONLINE
+#ifdef SIMULATOR
+    if (current_time == 61 && now.second() == 0 && !simulation) {
+#else
     if (current_time == 61 && now.second() == 0) {
+#endif
+      flushOutbound(true);
       checkForUpdate();
     }
+#endif
   }
 
   int i = -1;
   while (++i < smart_count) {
-    if (smart_array[i].enabled && (strContains(smart_array[i].days, "w") || (RTCisrunning() && strContains(smart_array[i].days, days_of_the_week[now.dayOfTheWeek()])))) {
+    if (smart_array[i].enabled && (strContains(smart_array[i].days, "w") || (RTCisrunning() && strContains(smart_array[i].days, String(getDayOfTheWeek(now.dayOfTheWeek())))))) {
       if (light_changed) {
         if (smart_array[i].on_at_night
         && (!smart_array[i].on_at_night_and_time || (smart_array[i].on_at_night_and_time && smart_array[i].on_at_night > -1 && smart_array[i].on_at_night < current_time) || (smart_array[i].react_to_cloudiness && cloudiness))
@@ -613,9 +1337,9 @@ bool automaticSettings(bool light_changed) {
             light2 = true;
           }
           result = true;
-          log += "lowering at ";
-          log += smart_array[i].react_to_cloudiness && cloudiness ? "cloudiness" : "dusk";
-          log += smart_array[i].on_at_night_and_time && twilight ? " and time" : "";
+          log += F("lowering at ");
+          log += smart_array[i].react_to_cloudiness && cloudiness ? F("cloudiness") : F("dusk");
+          log += smart_array[i].on_at_night_and_time && twilight ? F(" and time") : F("");
         }
         if (smart_array[i].off_at_day
         && (!smart_array[i].off_at_day_and_time || (smart_array[i].off_at_day_and_time && smart_array[i].off_at_day > -1 && smart_array[i].off_at_day < current_time) || (smart_array[i].react_to_cloudiness && !cloudiness))
@@ -627,9 +1351,9 @@ bool automaticSettings(bool light_changed) {
             light2 = false;
           }
           result = true;
-          log += "lifting at ";
-          log += smart_array[i].react_to_cloudiness && !cloudiness ? "sunshine" : "dawn";
-          log += smart_array[i].off_at_day_and_time && !twilight ? " and time" : "";
+          log += F("lifting at ");
+          log += smart_array[i].react_to_cloudiness && !cloudiness ? F("sunshine") : F("dawn");
+          log += smart_array[i].off_at_day_and_time && !twilight ? F(" and time") : F("");
         }
       } else {
         if (RTCisrunning() && smart_array[i].access + 60 < now.unixtime()) {
@@ -643,8 +1367,8 @@ bool automaticSettings(bool light_changed) {
               light2 = true;
             }
             result = true;
-            log += "on at time";
-            log += smart_array[i].on_at_night_and_time ? " and dusk" : "";
+            log += F("on at time");
+            log += smart_array[i].on_at_night_and_time ? F(" and dusk") : F("");
           }
           if (smart_array[i].off_time == current_time
           && (!smart_array[i].off_at_day_and_time || (smart_array[i].off_at_day_and_time && !twilight))) {
@@ -656,8 +1380,8 @@ bool automaticSettings(bool light_changed) {
               light2 = false;
             }
             result = true;
-            log += "off at time";
-            log += smart_array[i].off_at_day_and_time ? " and dawn" : "";
+            log += F("off at time");
+            log += smart_array[i].off_at_day_and_time ? F(" and dawn") : F("");
           }
         }
       }
@@ -665,34 +1389,113 @@ bool automaticSettings(bool light_changed) {
   }
 
   if (result) {
-    note(log);
+    NOTE_INFO(log);
     setLights("smart", true);
   } else {
     if (light_changed) {
-      note("Smart didn't activate anything.");
+      NOTE_DEBUG(F("Smart didn't activate anything."));
     }
   }
   return result;
 }
 
 void setLights(String orderer, bool put_online) {
-  String logs = "";
-  if (digitalRead(relay_pin[0]) != light1) {
-    logs += "\n 1 to " + String(light1);
+#ifdef SIMULATOR
+  if (simulation) {
+    recordTransition();
+    return;
   }
-  digitalWrite(relay_pin[0], light1);
+#endif
 
-  if (digitalRead(relay_pin[1]) != light2) {
-    logs += "\n 2 to " + String(light1);
-  }
+  // The relays may already have been switched by relayTimer(), so changes are judged against the last state set here.
+  bool changed1 = relay_light1 != light1;
+  bool changed2 = relay_light2 != light2;
+
+  digitalWrite(relay_pin[0], light1);
   digitalWrite(relay_pin[1], light2);
+  relay_light1 = light1;
+  relay_light2 = light2;
 
-  if (logs.length() > 0) {
-    note("Switch (" + orderer + "): " + logs);
-    saveSettings();
+  if (changed1 || changed2) {
+    state_version++;
+    if (trace_start != 0 && orderer == "manual") {
+      addToHistogram(press_latency, micros() - button_edge_time);
+    }
+    NOTE_INFO(String(F("Switch (")) + orderer + F("):") + (changed1 ? String(F("\n 1 to ")) + light1 : String()) + (changed2 ? String(F("\n 2 to ")) + light2 : String()));
+    if (orderer != "restore") {
+      deferTask(TASK_SAVE_SETTINGS);
+    }
 
     if (put_online) {
-      putOnlineData("val=" + getValue());
+      queueOutbound(String(F("val=")) + getValue() + getTrace());
     }
   }
 }
+
+void armSchedule() {
+  if (relay_armed || !RTCisrunning()) {
+    return;
+  }
+
+  DateTime now = RTC.now();
+  if (now.second() != 59) {
+    return;
+  }
+
+  DateTime next = DateTime(now.unixtime() + 1);
+  int next_time = (next.hour() * 60) + next.minute();
+  String day = String(getDayOfTheWeek(next.dayOfTheWeek()));
+  bool target[] = {light1, light2};
+
+  for (int i = 0; i < smart_count; i++) {
+    if (!smart_array[i].enabled || smart_array[i].access + 60 >= next.unixtime()
+    || !(strContains(smart_array[i].days, "w") || strContains(smart_array[i].days, day))) {
+      continue;
+    }
+    for (int j = 0; j < 2; j++) {
+      if (strContains(smart_array[i].lights, String(j + 1))) {
+        if (smart_array[i].on_time == next_time && (!smart_array[i].on_at_night_and_time || twilight)) {
+          target[j] = true;
+        }
+        if (smart_array[i].off_time == next_time && (!smart_array[i].off_at_day_and_time || !twilight)) {
+          target[j] = false;
+        }
+      }
+    }
+  }
+
+  uint32_t set_mask = 0;
+  uint32_t clear_mask = 0;
+  for (int j = 0; j < 2; j++) {
+    if (target[j] != (j == 0 ? light1 : light2)) {
+      if (target[j]) {
+        set_mask |= 1 << relay_pin[j];
+      } else {
+        clear_mask |= 1 << relay_pin[j];
+      }
+    }
+  }
+
+  int32_t wait = RTC.secondMillis() + 1000 - millis();
+  if ((set_mask == 0 && clear_mask == 0) || wait <= 0 || wait > 1000) {
+    return;
+  }
+
+  relay_set_mask = set_mask;
+  relay_clear_mask = clear_mask;
+  relay_target = micros() + wait * 1000;
+  relay_armed = true;
+
+  timer1_attachInterrupt(relayTimer);
+  timer1_enable(TIM_DIV16, TIM_EDGE, TIM_SINGLE);
+  timer1_write(wait * 5000);
+}
+
+void IRAM_ATTR relayTimer() {
+  GPOS = relay_set_mask;
+  GPOC = relay_clear_mask;
+  relay_late = micros() - relay_target;
+  relay_fired = true;
+  relay_armed = false;
+  timer1_disable();
+}
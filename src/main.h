@@ -8,8 +8,28 @@ const int version = 13;
 const int led_pin = 16;
 const int relay_pin[] = {13, 4};
 
-Switch button1 = Switch(12);
-Switch button2 = Switch(14);
+const int button_pin[] = {12, 14};
+
+Switch button1 = Switch(button_pin[0]);
+Switch button2 = Switch(button_pin[1]);
+
+volatile bool button_edge = false;
+volatile uint32_t button_edge_time = 0;
+uint32_t button_awake_until = 0;
+
+// Idle loop statistics, the duty cycle is the awake share of the last minute in percent.
+uint32_t idle_window_start = 0;
+uint32_t idle_sleep_time = 0;
+uint32_t total_sleep_time = 0;
+int duty_cycle = 100;
+uint32_t wake_latency = 0;
+uint32_t loop_wake = 0;
+
+// The scheduled work of loop() only runs at next_event, network services are polled every service_interval in between.
+const uint32_t service_interval = 100;
+uint32_t next_event = 0;
+uint32_t schedule_time = 0;
+uint32_t schedule_version = 0;
 
 bool restore_on_power_loss = false;
 
@@ -27,31 +47,129 @@ struct Smart {
   uint32_t access;
 };
 
+const uint32_t settings_magic = 0x6d6f4469;
+const uint16_t settings_layout = 5;
+
+// Binary settings file, new fields are only ever appended so older images stay readable.
+// The smart string and a CRC32 of everything before it follow the image.
+struct SettingsImage {
+  uint32_t magic;
+  uint16_t layout;
+  uint16_t size;
+  char ssid[33];
+  char password[65];
+  char location[32];
+  int32_t offset;
+  int32_t window;
+  int16_t dusk_delay;
+  int16_t dawn_delay;
+  bool dst;
+  bool restore;
+  bool sensors;
+  bool light1;
+  bool light2;
+  uint16_t smart_length;
+  uint8_t bssid[6];
+  int32_t channel;
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+  uint32_t sync_clock;
+  uint32_t sync_sequence;
+  uint32_t offset_stamp[2];
+  uint32_t dst_stamp[2];
+  uint32_t cursor_ip[8];
+  uint32_t cursor_sequence[8];
+  int32_t lease_boot;
+  uint32_t cursor_epoch[8];
+};
+
+const uint8_t relay_record_magic = 0xa5;
+
+// Minimal copy of the relay state kept in the EEPROM sector, readable before the file system is mounted.
+struct RelayRecord {
+  uint8_t magic;
+  bool restore;
+  bool light1;
+  bool light2;
+};
+
 bool light1 = false;
 bool light2 = false;
+bool relay_light1 = false;
+bool relay_light2 = false;
+
+// Smart time rules of the coming minute are armed on timer1 during its last second and switched from the interrupt.
+volatile bool relay_armed = false;
+volatile bool relay_fired = false;
+volatile uint32_t relay_set_mask = 0;
+volatile uint32_t relay_clear_mask = 0;
+volatile uint32_t relay_target = 0;
+volatile int32_t relay_late = 0;
 
 int twilight_counter = 0;
 
 bool twilight = false;
 bool cloudiness = false;
 
+struct LightSample {
+  uint32_t time;
+  bool dark;
+};
+
+// Light readings of all sensors from the last light_window seconds, two thirds of them have to agree on a change.
+// After a change the state is held for at least light_dwell seconds, readings that did not cause a flip are counted.
+LightSample light_samples[8] = {};
+int light_head = 0;
+const uint32_t light_window = 600;
+const uint32_t light_dwell = 300;
+uint32_t light_changed = 0;
+uint32_t light_suppressed = 0;
+
+void restoreRelays();
+void saveRelayRecord();
 bool readSettings(bool backup);
+bool readLegacySettings(bool backup);
+void readUprisings();
+void saveUprisings();
 void saveSettings();
 void saveSettings(bool log);
+bool writeSettingsImage(const char* name, SettingsImage& image, uint32_t crc);
 void sayHelloToTheServer();
 void introductionToServer();
+void onRoute(const __FlashStringHelper* uri, WebRequestMethod method, ArRequestHandlerFunction handler, ArBodyHandlerFunction body);
 void startServices();
 String getSwitchDetail();
 String getValue();
-void handshake();
-void requestForState();
-void exchangeOfBasicData();
+void handshake(AsyncWebServerRequest *request);
+void requestForState(AsyncWebServerRequest *request);
+void exchangeOfBasicData(AsyncWebServerRequest *request);
+void requestForStats(AsyncWebServerRequest *request);
 void button1Single(void* s);
 void button2Single(void* s);
 bool hasTheLightChanged();
 void readData(String payload, bool per_wifi);
+void readData(String payload, bool per_wifi, bool peer);
+void receivedLight(bool dark);
+bool isDark();
+void aggregateLight();
+void changeLight(bool dark);
 void setSmart();
 bool automaticSettings();
 bool automaticSettings(bool light_changed);
 void handleGesture();
+void runDeferredTasks();
+void buttonEdge();
+uint32_t nextEventTime();
+void addEventMinute(uint32_t& due, uint32_t now, int minute, int second);
+uint32_t nextDeadline();
+void waitForNextEvent();
+void flushOutbound(bool force);
+#if FEATURE_ONLINE
+void requestForUpdate(AsyncWebServerRequest *request);
+void replayOutbox();
+#endif
 void setLights(String orderer, bool put_online);
+void armSchedule();
+void relayTimer();
@@ -0,0 +1,206 @@
+// Replays the smart settings against a virtual clock, a year takes seconds instead of a year.
+// Only built with -D SIMULATOR, the relays, the settings and the notifications stay untouched.
+
+bool simulation = false;
+String simulation_request = "";
+String simulation_result = "";
+
+uint32_t simulation_time = 0;
+int simulation_transitions = 0;
+bool simulation_light1 = false;
+bool simulation_light2 = false;
+String simulation_log = "";
+
+void requestForSimulation(AsyncWebServerRequest *request);
+void requestForSimulationResult(AsyncWebServerRequest *request);
+void runSimulation();
+void recordTransition();
+int simulatedSun(int day_of_year, int first, int second);
+
+
+void requestForSimulation(AsyncWebServerRequest *request) {
+  if (simulation || simulation_request.length() > 0) {
+    request->send(409, F("text/plain"), F("Simulation in progress"));
+    return;
+  }
+
+  simulation_request = hasBody(request) ? getBody(request) : "{}";
+  simulation_result = "";
+  deferTask(TASK_SIMULATION);
+
+  request->send(202, F("text/plain"), F("Simulation started"));
+}
+
+void requestForSimulationResult(AsyncWebServerRequest *request) {
+  if (simulation_result.length() == 0) {
+    request->send(404, F("text/plain"), F("No simulation result"));
+    return;
+  }
+
+  request->send(200, F("text/plain"), simulation_result);
+}
+
+void runSimulation() {
+  DynamicJsonDocument json_object(1024);
+  deserializeJson(json_object, simulation_request);
+  simulation_request = "";
+
+  int days = json_object.containsKey(F("days")) ? json_object[F("days")].as<int>() : 365;
+  uint32_t start = json_object.containsKey(F("start")) ? json_object[F("start")].as<uint32_t>() : RTC.now().unixtime();
+  start -= start % 86400;
+  int sunrise[] = {json_object[F("sunrise")][0] | 240, json_object[F("sunrise")][1] | 465};
+  int sunset[] = {json_object[F("sunset")][0] | 930, json_object[F("sunset")][1] | 1260};
+  String light_events = json_object.containsKey(F("light")) ? json_object[F("light")].as<String>() : "";
+
+  bool saved_light1 = light1;
+  bool saved_light2 = light2;
+  bool saved_twilight = twilight;
+  bool saved_cloudiness = cloudiness;
+  bool saved_dst = dst;
+  int saved_twilight_counter = twilight_counter;
+  LightSample saved_light_samples[8];
+  memcpy(saved_light_samples, light_samples, sizeof(light_samples));
+  int saved_light_head = light_head;
+  uint32_t saved_light_changed = light_changed;
+  uint32_t saved_light_suppressed = light_suppressed;
+  int saved_next_sunrise = next_sunrise;
+  int saved_next_sunset = next_sunset;
+  int saved_last_sun_check = last_sun_check;
+  int saved_log_level = log_level;
+  uint32_t saved_loop_time = loop_time;
+  uint32_t saved_sync_clock = sync_clock;
+  uint32_t saved_sync_sequence = sync_sequence;
+  Stamp saved_dst_stamp = dst_stamp;
+  Stamp saved_twilight_stamp = twilight_stamp;
+  uint32_t saved_time = RTC.now().unixtime();
+  uint32_t* saved_access = new uint32_t[smart_count];
+  for (int i = 0; i < smart_count; i++) {
+    saved_access[i] = smart_array[i].access;
+    smart_array[i].access = 0;
+  }
+
+  simulation = true;
+  simulation_transitions = 0;
+  simulation_light1 = light1;
+  simulation_light2 = light2;
+  simulation_log = "";
+  log_level = 0;
+  tasks_muted = true;
+  memset(light_samples, 0, sizeof(light_samples));
+  light_changed = 0;
+  light_suppressed = 0;
+
+  uint32_t real_start = millis();
+  uint32_t end = start + days * 86400;
+  int light_count = 0;
+  for (char c: light_events) {
+    if (c == ',') {
+      light_count++;
+    }
+  }
+  light_count += light_events.length() > 0 ? 1 : 0;
+
+  for (uint32_t t = start; t < end; t += 60) {
+    simulation_time = t;
+    RTC.adjust(DateTime(t));
+    loop_time = t;
+    DateTime now = RTC.now();
+    int current_time = (now.hour() * 60) + now.minute();
+
+    if (last_sun_check != now.day()) {
+      int day_of_year = fmod(t / 86400.0, 365.2425);
+      next_sunrise = simulatedSun(day_of_year, sunrise[1], sunrise[0]) + (dst ? 60 : 0) + dawn_delay;
+      next_sunset = simulatedSun(day_of_year, sunset[0], sunset[1]) + (dst ? 60 : 0) + dusk_delay;
+      last_sun_check = now.day();
+    }
+
+    for (int i = 0; i < light_count; i++) {
+      String event = get1(light_events, i);
+      if (event.toInt() == current_time) {
+        receivedLight(strContains(event, "t"));
+      }
+    }
+    aggregateLight();
+
+    if (twilight_counter > 0) {
+      twilight_counter = max(twilight_counter - 60, 0);
+      if (twilight_counter == 0) {
+        automaticSettings(true);
+      }
+    }
+
+    bool was_dst = dst;
+    automaticSettings();
+    if (dst != was_dst) {
+      t += dst ? 3600 : -3600;
+    }
+
+    if (current_time % 60 == 0) {
+      tasks_muted = false;
+      yield();
+      tasks_muted = true;
+    }
+  }
+
+  uint32_t real_time = millis() - real_start;
+  uint32_t suppressed = light_suppressed;
+  if (real_time == 0) {
+    real_time = 1;
+  }
+
+  simulation = false;
+  log_level = saved_log_level;
+  tasks_muted = false;
+  light1 = saved_light1;
+  light2 = saved_light2;
+  twilight = saved_twilight;
+  cloudiness = saved_cloudiness;
+  dst = saved_dst;
+  twilight_counter = saved_twilight_counter;
+  memcpy(light_samples, saved_light_samples, sizeof(light_samples));
+  light_head = saved_light_head;
+  light_changed = saved_light_changed;
+  light_suppressed = saved_light_suppressed;
+  next_sunrise = saved_next_sunrise;
+  next_sunset = saved_next_sunset;
+  last_sun_check = saved_last_sun_check;
+  loop_time = saved_loop_time;
+  sync_clock = saved_sync_clock;
+  sync_sequence = saved_sync_sequence;
+  dst_stamp = saved_dst_stamp;
+  twilight_stamp = saved_twilight_stamp;
+  RTC.adjust(DateTime(saved_time + real_time / 1000));
+  for (int i = 0; i < smart_count; i++) {
+    smart_array[i].access = saved_access[i];
+  }
+  delete [] saved_access;
+
+  simulation_result = String(F("{\"days\":")) + String(days)
+  + F(",\"transitions\":") + simulation_transitions
+  + F(",\"suppressed\":") + suppressed
+  + F(",\"time\":") + real_time
+  + F(",\"days_per_second\":") + String(days * 1000.0 / real_time, 1)
+  + F(",\"log\":\"") + simulation_log + F("\"}");
+
+  NOTE_INFO(String(F("Simulation of ")) + String(days) + F(" days took ") + String(real_time) + F(" ms"));
+}
+
+void recordTransition() {
+  if (light1 == simulation_light1 && light2 == simulation_light2) {
+    return;
+  }
+
+  simulation_light1 = light1;
+  simulation_light2 = light2;
+  simulation_transitions++;
+
+  if (simulation_log.length() < 4096) {
+    simulation_log += String(simulation_log.length() > 0 ? "," : "") + simulation_time + ":" + getValue();
+  }
+}
+
+int simulatedSun(int day_of_year, int first, int second) {
+  // The first value is reached at the winter solstice, the second one at the summer solstice.
+  float winter = (cos(2 * PI * (day_of_year + 10) / 365.0) + 1) / 2;
+  return second + (first - second) * winter;
+}
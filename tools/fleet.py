@@ -0,0 +1,337 @@
+#!/usr/bin/env python3
+"""Fleet simulator for the peer traffic of the switches.
+
+Runs many switch instances in one process. Every instance has its own HTTP
+server on the loopback interface and speaks the peer protocol of the
+firmware: POST /basicdata with "since" and stamped, sequence-numbered
+replies for the boot sync, and PUT /set with a "trace" for state updates.
+A shared registry stands in for the mDNS discovery of findMDNSDevices().
+
+For each fleet size the harness boots every instance, which syncs with up
+to eight peers like getOfflineData(). It then presses buttons on random
+instances, and each press is broadcast to every peer like
+putMultiOfflineData(). It reports the message counts, the propagation
+latency from a press to the last peer and the CPU time spent per device.
+
+    tools/fleet.py --sizes 2,10,50,100,250,500 --presses 20 --workers 64
+"""
+
+import argparse
+import http.client
+import http.server
+import json
+import random
+import statistics
+import threading
+import time
+from concurrent.futures import ThreadPoolExecutor, wait
+
+DEVICES_LIMIT = 8
+SYNC_QUORUM = 2
+SYNC_TIMEOUT = 3.0
+
+
+class Registry:
+    """Stand-in for mDNS, every started instance announces itself here."""
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.ports = []
+        self.queries = 0
+
+    def announce(self, port):
+        with self.lock:
+            self.ports.append(port)
+
+    def query(self, own):
+        with self.lock:
+            self.queries += 1
+            return [port for port in self.ports if port != own]
+
+
+class Fleet:
+    """Counters shared by all instances of one run."""
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.presses = {}
+        self.hops = []
+
+    def press(self, trace, expected):
+        with self.lock:
+            self.presses[trace] = {"start": time.monotonic(), "expected": expected, "arrivals": []}
+
+    def arrival(self, trace):
+        now = time.monotonic()
+        with self.lock:
+            press = self.presses.get(trace)
+            if press is not None:
+                press["arrivals"].append(now)
+                self.hops.append(now - press["start"])
+
+
+class Switch:
+    def __init__(self, number, registry, fleet, pool):
+        self.id = "5C:CF:7F:%02X:%02X:%02X" % (number >> 16 & 0xff, number >> 8 & 0xff, number & 0xff)
+        self.chip = number & 0xff
+        self.registry = registry
+        self.fleet = fleet
+        self.pool = pool
+        self.lock = threading.Lock()
+
+        self.value = "0"
+        self.offset = 3600 if number == 0 else 0
+        self.dst = False
+        self.sync_clock = 0
+        self.sync_sequence = 0
+        self.epoch = random.getrandbits(32) or 1
+        self.offset_stamp = [(1 << 8) | self.chip, 1] if number == 0 else [0, 0]
+        self.dst_stamp = [0, 0]
+        self.cursors = {}
+        self.devices = []
+
+        self.sent = 0
+        self.failed = 0
+        self.received = 0
+        self.cpu = 0.0
+
+        switch = self
+
+        class Handler(http.server.BaseHTTPRequestHandler):
+            protocol_version = "HTTP/1.1"
+
+            def log_message(self, *args):
+                pass
+
+            def do_PUT(self):
+                start = time.thread_time()
+                body = self.rfile.read(int(self.headers.get("Content-Length", 0)))
+                if self.path == "/set":
+                    switch.received_data(body)
+                    self.answer(200, "Data has received")
+                else:
+                    self.answer(404, "Not found")
+                switch.add_cpu(time.thread_time() - start)
+
+            def do_POST(self):
+                start = time.thread_time()
+                body = self.rfile.read(int(self.headers.get("Content-Length", 0)))
+                if self.path == "/basicdata":
+                    self.answer(200, switch.basic_data(body))
+                else:
+                    self.answer(404, "Not found")
+                switch.add_cpu(time.thread_time() - start)
+
+            def answer(self, code, text):
+                data = text.encode()
+                self.send_response(code)
+                self.send_header("Content-Type", "text/plain")
+                self.send_header("Content-Length", str(len(data)))
+                self.send_header("Connection", "close")
+                self.end_headers()
+                self.wfile.write(data)
+                self.close_connection = True
+
+        class Server(http.server.ThreadingHTTPServer):
+            request_queue_size = 128
+            daemon_threads = True
+
+        self.server = Server(("127.0.0.1", 0), Handler)
+        self.port = self.server.server_address[1]
+        self.thread = threading.Thread(target=self.server.serve_forever, args=(0.05,), daemon=True)
+
+    def start(self):
+        self.thread.start()
+        self.registry.announce(self.port)
+
+    def stop(self):
+        self.server.shutdown()
+        self.server.server_close()
+
+    def add_cpu(self, seconds):
+        with self.lock:
+            self.cpu += seconds
+
+    # takeStamp(): a zero stamp from a peer is the oldest value, only the device itself creates new stamps.
+    def take_stamp(self, stamp, remote, local):
+        self.sync_clock = max(self.sync_clock, remote >> 8)
+        if local:
+            self.sync_clock += 1
+            stamp[0] = (self.sync_clock << 8) | self.chip
+        elif remote > stamp[0]:
+            stamp[0] = remote
+        else:
+            return False
+        self.sync_sequence += 1
+        stamp[1] = self.sync_sequence
+        return True
+
+    def basic_data(self, body):
+        request = json.loads(body or b"{}")
+        since = request.get("since", 0)
+        with self.lock:
+            self.received += 1
+            if since > self.sync_sequence or request.get("epoch", 0) != self.epoch:
+                since = 0
+            reply = {"seq": self.sync_sequence, "epoch": self.epoch}
+            if since == 0 or self.offset_stamp[1] > since:
+                reply["offset"] = self.offset
+                reply["offset_stamp"] = self.offset_stamp[0]
+            if since == 0 or self.dst_stamp[1] > since:
+                reply["dst"] = int(self.dst)
+                reply["dst_stamp"] = self.dst_stamp[0]
+            reply["time"] = int(time.time())
+        return json.dumps(reply, separators=(",", ":"))
+
+    def received_data(self, body):
+        data = json.loads(body)
+        if "trace" in data:
+            self.fleet.arrival(data["trace"])
+        with self.lock:
+            self.received += 1
+            self.merge(data)
+
+    def merge(self, data):
+        if "offset" in data and data["offset"] != self.offset and self.take_stamp(self.offset_stamp, data.get("offset_stamp", 0), False):
+            self.offset = data["offset"]
+        if "dst" in data and bool(data["dst"]) != self.dst and self.take_stamp(self.dst_stamp, data.get("dst_stamp", 0), False):
+            self.dst = bool(data["dst"])
+        if "val" in data:
+            self.value = data["val"]
+
+    def request(self, port, method, path, body):
+        start = time.thread_time()
+        connection = http.client.HTTPConnection("127.0.0.1", port, timeout=SYNC_TIMEOUT)
+        try:
+            connection.request(method, path, body, {"Content-Type": "text/plain"})
+            response = connection.getresponse()
+            reply = response.read()
+            ok = response.status == 200
+        except OSError:
+            reply = b""
+            ok = False
+        finally:
+            connection.close()
+        with self.lock:
+            self.sent += 1
+            self.failed += 0 if ok else 1
+            self.cpu += time.thread_time() - start
+        return reply if ok else None
+
+    def discover(self):
+        if not self.devices:
+            self.devices = self.registry.query(self.port)
+        return self.devices
+
+    def boot_sync(self):
+        """getOfflineData(): ask up to eight peers in parallel and apply the first answer a quorum agrees on."""
+        peers = self.discover()[:DEVICES_LIMIT]
+        if not peers:
+            return
+        futures = {}
+        for port in peers:
+            since, epoch = self.cursors.get(port, (0, 0))
+            body = json.dumps({"id": self.id, "since": since, "epoch": epoch})
+            futures[port] = self.pool.submit(self.request, port, "POST", "/basicdata", body)
+        wait(futures.values(), timeout=SYNC_TIMEOUT)
+
+        replies = {}
+        for port, future in futures.items():
+            if future.done() and future.result():
+                replies[port] = json.loads(future.result())
+
+        accepted = None
+        for port, reply in replies.items():
+            agreeing = sum(1 for other in replies.values() if abs(other.get("time", 0) - reply.get("time", 0)) <= 60)
+            if agreeing >= min(len(peers), SYNC_QUORUM):
+                accepted = port
+                break
+
+        with self.lock:
+            for port, reply in replies.items():
+                if port != accepted:
+                    self.merge({key: value for key, value in reply.items() if key != "time"})
+                self.cursors[port] = (reply.get("seq", 0), reply.get("epoch", 0))
+            if accepted is not None:
+                self.merge(replies[accepted])
+
+    def press(self):
+        """A button press, broadcast to every peer like putMultiOfflineData()."""
+        with self.lock:
+            self.value = "0" if self.value != "0" else "1"
+            value = self.value
+        peers = self.discover()
+        trace = "%04x.%d" % (random.getrandbits(16), int(time.time() * 1000) % 86400000)
+        self.fleet.press(trace, len(peers))
+        body = json.dumps({"val": value, "trace": trace})
+        return [self.pool.submit(self.request, port, "PUT", "/set", body) for port in peers]
+
+
+def percentile(values, share):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * share))]
+
+
+def run(size, presses, workers):
+    registry = Registry()
+    fleet = Fleet()
+    with ThreadPoolExecutor(max_workers=workers) as pool, ThreadPoolExecutor(max_workers=workers) as boots:
+        switches = [Switch(number, registry, fleet, pool) for number in range(size)]
+        for switch in switches:
+            switch.start()
+
+        start = time.monotonic()
+        wait([boots.submit(switch.boot_sync) for switch in switches])
+        boot_time = time.monotonic() - start
+
+        futures = []
+        for _ in range(presses):
+            futures += random.choice(switches).press()
+        wait(futures)
+
+        wait([boots.submit(switch.stop) for switch in switches])
+
+    spreads = [max(press["arrivals"]) - press["start"] for press in fleet.presses.values() if press["arrivals"]]
+    complete = sum(1 for press in fleet.presses.values() if len(press["arrivals"]) == press["expected"])
+    synced = sum(1 for switch in switches if switch.offset == 3600)
+    sent = sum(switch.sent for switch in switches)
+    return {
+        "devices": size,
+        "sent": sent,
+        "failed": sum(switch.failed for switch in switches),
+        "per_device": sent / size,
+        "mdns": registry.queries,
+        "boot_ms": boot_time * 1000,
+        "synced": synced,
+        "hop_p50_ms": percentile(fleet.hops, 0.5) * 1000,
+        "hop_p99_ms": percentile(fleet.hops, 0.99) * 1000,
+        "spread_ms": statistics.mean(spreads) * 1000 if spreads else 0.0,
+        "complete": "%d/%d" % (complete, len(fleet.presses)),
+        "cpu_ms": statistics.mean(switch.cpu for switch in switches) * 1000,
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Simulate the peer traffic of a fleet of switches on the loopback interface.")
+    parser.add_argument("--sizes", default="2,10,50,100,250,500", help="comma separated fleet sizes")
+    parser.add_argument("--presses", type=int, default=20, help="button presses per fleet size")
+    parser.add_argument("--workers", type=int, default=64, help="worker threads sending the requests")
+    parser.add_argument("--json", action="store_true", help="print one JSON object per fleet size")
+    arguments = parser.parse_args()
+
+    columns = ["devices", "sent", "failed", "per_device", "mdns", "boot_ms", "synced", "hop_p50_ms", "hop_p99_ms", "spread_ms", "complete", "cpu_ms"]
+    if not arguments.json:
+        print(" ".join("%11s" % column for column in columns))
+
+    for size in [int(size) for size in arguments.sizes.split(",")]:
+        result = run(size, arguments.presses, arguments.workers)
+        if arguments.json:
+            print(json.dumps(result))
+        else:
+            print(" ".join("%11.1f" % result[column] if isinstance(result[column], float) else "%11s" % result[column] for column in columns))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,326 @@
+#!/usr/bin/env python3
+"""Load generator for the HTTP control surface of a switch.
+
+"run" replays a mix of GET /state, PUT /set and POST /hello at fixed total
+rates against a switch. The arrivals are open loop: every request has its
+scheduled send time and its latency is measured from that time, so a slow
+device can't hide its queueing by holding back the generator. For every
+rate it reports the p50, p99 and p999 latency and the error share of each
+endpoint, together with what the firmware saw during the run from /stats:
+the new stalls, throttled, overloaded and failed requests and the loop
+and handler percentiles. The capacity is the highest rate that stayed
+within the latency objective without errors or stalls.
+
+The firmware limits every client address to 5 parsing requests (/set,
+/hello with a body) per second with a burst of 10 and answers the rest
+with 429 "Too many requests". From a single host that limit is reached
+long before the device is busy, so these answers are counted as
+"throttled", apart from the errors, and left out of the latency and the
+capacity. A 429 "Device busy" from the bucket shared by all clients is
+an error like any other.
+
+    tools/load.py run --target 192.168.1.20 --rates 5,10,20,40 --duration 20
+
+"peer" starts a stand-in switch on this computer. It answers the same
+endpoints as the firmware one request at a time with a fixed service time,
+so the generator can be tried without a device. Its address can also be put
+in "devices" of a real switch to count the updates the switch broadcasts
+under load (the firmware sends them to port 80).
+
+    tools/load.py peer --port 8080 --service-ms 3
+"""
+
+import argparse
+import http.client
+import http.server
+import json
+import random
+import threading
+import time
+from collections import defaultdict
+from concurrent.futures import ThreadPoolExecutor
+
+ENDPOINTS = {
+    "state": ("GET", "/state"),
+    "set": ("PUT", "/set"),
+    "hello": ("POST", "/hello"),
+}
+COUNTERS = ["stalls", "throttled", "overloaded", "errors", "not_modified", "received"]
+
+
+def percentile(values, share):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * share))]
+
+
+def request(host, port, method, path, body, timeout):
+    connection = http.client.HTTPConnection(host, port, timeout=timeout)
+    try:
+        headers = {"Content-Type": "text/plain", "Connection": "close"} if body is not None else {"Connection": "close"}
+        connection.request(method, path, body=body, headers=headers)
+        reply = connection.getresponse()
+        data = reply.read()
+        return reply.status, data
+    finally:
+        connection.close()
+
+
+def read_stats(host, port, timeout):
+    try:
+        status, data = request(host, port, "GET", "/stats", None, timeout)
+        return json.loads(data) if status == 200 else None
+    except (OSError, ValueError, http.client.HTTPException):
+        return None
+
+
+def body_of(name, arguments):
+    if name == "set":
+        return json.dumps({"val": random.choice(arguments.values.split(","))})
+    if name == "hello":
+        return ""
+    return None
+
+
+def run_rate(rate, mix, arguments):
+    names = list(mix)
+    weights = [mix[name] for name in names]
+    latencies = defaultdict(list)
+    statuses = defaultdict(lambda: defaultdict(int))
+    lock = threading.Lock()
+
+    def send(name, due):
+        method, path = ENDPOINTS[name]
+        try:
+            status, data = request(arguments.target, arguments.port, method, path, body_of(name, arguments), arguments.timeout)
+            if status == 429 and data.startswith(b"Too many requests"):
+                status = "throttled"
+        except (OSError, http.client.HTTPException):
+            status = "error"
+        latency = time.monotonic() - due
+        with lock:
+            if status != "throttled":
+                latencies[name].append(latency)
+            statuses[name][status] += 1
+
+    before = read_stats(arguments.target, arguments.port, arguments.timeout)
+    with ThreadPoolExecutor(max_workers=arguments.workers) as pool:
+        start = time.monotonic()
+        due = start
+        while due < start + arguments.duration:
+            due += random.expovariate(rate)
+            delay = due - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+            pool.submit(send, random.choices(names, weights)[0], due)
+    time.sleep(arguments.settle)
+    after = read_stats(arguments.target, arguments.port, arguments.timeout)
+
+    result = {"rate": rate, "endpoints": {}}
+    failed = 0
+    total = 0
+    throttled = 0
+    for name in names:
+        count = len(latencies[name])
+        errors = sum(number for status, number in statuses[name].items() if status not in (200, 304, "throttled"))
+        failed += errors
+        total += count
+        throttled += statuses[name].get("throttled", 0)
+        result["endpoints"][name] = {
+            "count": count,
+            "throttled": statuses[name].get("throttled", 0),
+            "p50_ms": percentile(latencies[name], 0.5) * 1000,
+            "p99_ms": percentile(latencies[name], 0.99) * 1000,
+            "p999_ms": percentile(latencies[name], 0.999) * 1000,
+            "error_share": errors / count if count else 0.0,
+            "statuses": {str(status): number for status, number in statuses[name].items()},
+        }
+    result["error_share"] = failed / total if total else 0.0
+    result["throttled_share"] = throttled / (total + throttled) if total + throttled else 0.0
+    result["p99_ms"] = max((endpoint["p99_ms"] for endpoint in result["endpoints"].values()), default=0.0)
+
+    if before is not None and after is not None:
+        result["firmware"] = {counter: after.get(counter, 0) - before.get(counter, 0) for counter in COUNTERS}
+        for histogram in ["loop", "state", "set", "hello"]:
+            result["firmware"][histogram] = {key: after.get(histogram, {}).get(key, 0) for key in ["p99", "p999", "max"]}
+    else:
+        result["firmware"] = None
+    return result
+
+
+def within_objective(result, arguments):
+    firmware = result["firmware"] or {}
+    return result["error_share"] <= arguments.max_errors and result["p99_ms"] <= arguments.slo and firmware.get("stalls", 0) == 0
+
+
+def print_result(result):
+    firmware = result["firmware"]
+    print("rate %.1f/s, errors %.2f %%, throttled %.2f %%" % (result["rate"], result["error_share"] * 100, result["throttled_share"] * 100))
+    for name, endpoint in result["endpoints"].items():
+        print("  %-6s %6d  p50 %8.1f  p99 %8.1f  p999 %8.1f ms  errors %.2f %%  throttled %d  %s" % (
+            name, endpoint["count"], endpoint["p50_ms"], endpoint["p99_ms"], endpoint["p999_ms"],
+            endpoint["error_share"] * 100, endpoint["throttled"], " ".join("%s:%d" % item for item in sorted(endpoint["statuses"].items()))))
+    if firmware is None:
+        print("  firmware /stats not available")
+        return
+    print("  firmware " + ", ".join("%s +%d" % (counter, firmware[counter]) for counter in COUNTERS))
+    for histogram in ["loop", "state", "set", "hello"]:
+        values = firmware[histogram]
+        print("  firmware %-6s p99 %d  p999 %d  max %d us" % (histogram, values["p99"], values["p999"], values["max"]))
+
+
+def run(arguments):
+    mix = {}
+    for item in arguments.mix.split(","):
+        name, weight = item.split("=")
+        if name not in ENDPOINTS:
+            raise SystemExit("unknown endpoint " + name)
+        mix[name] = float(weight)
+
+    capacity = 0.0
+    results = []
+    for rate in [float(rate) for rate in arguments.rates.split(",")]:
+        result = run_rate(rate, mix, arguments)
+        results.append(result)
+        if arguments.json:
+            print(json.dumps(result))
+        else:
+            print_result(result)
+        if not within_objective(result, arguments):
+            break
+        capacity = rate
+        time.sleep(arguments.pause)
+
+    if arguments.json:
+        print(json.dumps({"capacity": capacity}))
+    else:
+        print("capacity %.1f requests/s (p99 <= %.0f ms, errors <= %.2f %%, no stalls, throttled answers excluded)" % (capacity, arguments.slo, arguments.max_errors * 100))
+
+
+class Peer:
+    """Stand-in switch, one request at a time like the single core of the ESP8266."""
+
+    def __init__(self, service):
+        self.service = service
+        self.value = "0"
+        self.version = 1
+        self.counters = defaultdict(int)
+        self.latencies = defaultdict(list)
+        self.started = time.monotonic()
+
+    def handle(self, method, path, body, headers):
+        start = time.monotonic()
+        time.sleep(self.service)
+        code, text, etag = self.answer(method, path.split("?")[0], body, headers)
+        if path.startswith("/state") or path.startswith("/set") or path.startswith("/hello"):
+            self.latencies[path.strip("/").split("?")[0]].append(int((time.monotonic() - start) * 1000000))
+        return code, text, etag
+
+    def answer(self, method, path, body, headers):
+        etag = '"%x"' % self.version
+        if path == "/state" and method == "GET":
+            if headers.get("If-None-Match") == etag:
+                self.counters["not_modified"] += 1
+                return 304, "", etag
+            return 200, json.dumps({"state": int(self.value)}), etag
+        if path == "/set" and method == "PUT":
+            self.counters["received"] += 1
+            try:
+                data = json.loads(body or b"{}")
+            except ValueError:
+                self.counters["errors"] += 1
+                return 400, "Parsing failed", None
+            if "val" in data and str(data["val"]) != self.value:
+                self.value = str(data["val"])
+                self.version += 1
+            return 200, "Data has received", None
+        if path == "/hello" and method == "POST":
+            if not body and headers.get("If-None-Match") == etag:
+                self.counters["not_modified"] += 1
+                return 304, "", etag
+            return 200, json.dumps({"id": "5C:CF:7F:00:00:00", "value": int(self.value), "version": 13}), etag
+        if path == "/basicdata" and method == "POST":
+            return 200, json.dumps({"id": "5C:CF:7F:00:00:00", "seq": self.version}), None
+        if path == "/stats" and method == "GET":
+            stats = dict(self.counters)
+            stats["uptime"] = int((time.monotonic() - self.started) * 1000)
+            for name in ["state", "set", "hello"]:
+                values = self.latencies[name]
+                stats[name] = {"count": len(values), "p50": percentile(values, 0.5), "p99": percentile(values, 0.99),
+                               "p999": percentile(values, 0.999), "max": max(values, default=0)}
+            stats["loop"] = {"count": 0, "p50": 0, "p99": 0, "p999": 0, "max": 0}
+            stats["stalls"] = 0
+            return 200, json.dumps(stats), None
+        return 404, "Not found", None
+
+
+def peer(arguments):
+    switch = Peer(arguments.service_ms / 1000)
+
+    class Handler(http.server.BaseHTTPRequestHandler):
+        protocol_version = "HTTP/1.1"
+
+        def log_message(self, *args):
+            pass
+
+        def reply(self):
+            body = self.rfile.read(int(self.headers.get("Content-Length", 0)))
+            code, text, etag = switch.handle(self.command, self.path, body, self.headers)
+            data = text.encode()
+            self.send_response(code)
+            self.send_header("Content-Type", "text/plain")
+            self.send_header("Content-Length", str(len(data)))
+            if etag:
+                self.send_header("ETag", etag)
+            self.send_header("Connection", "close")
+            self.end_headers()
+            self.wfile.write(data)
+            self.close_connection = True
+
+        do_GET = do_PUT = do_POST = do_DELETE = reply
+
+    server = http.server.HTTPServer((arguments.address, arguments.port), Handler)
+    server.request_queue_size = 16
+    print("stand-in switch on %s:%d, %.1f ms per request" % (arguments.address, server.server_address[1], arguments.service_ms))
+    try:
+        server.serve_forever(0.05)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        server.server_close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Load test the HTTP control surface of a switch.")
+    commands = parser.add_subparsers(dest="command", required=True)
+
+    runner = commands.add_parser("run", help="replay a request mix at increasing rates")
+    runner.add_argument("--target", required=True, help="address of the switch")
+    runner.add_argument("--port", type=int, default=80)
+    runner.add_argument("--mix", default="state=20,set=2,hello=1", help="relative weights of the endpoints")
+    runner.add_argument("--rates", default="2,5,10,20,40", help="comma separated total rates in requests per second")
+    runner.add_argument("--duration", type=float, default=20, help="seconds per rate")
+    runner.add_argument("--values", default="0,1", help="comma separated values sent as \"val\" to /set")
+    runner.add_argument("--slo", type=float, default=250, help="p99 latency objective in milliseconds")
+    runner.add_argument("--max-errors", type=float, default=0.01, help="highest accepted share of failed requests")
+    runner.add_argument("--timeout", type=float, default=5)
+    runner.add_argument("--workers", type=int, default=32)
+    runner.add_argument("--settle", type=float, default=1, help="seconds to wait for the last replies before reading /stats")
+    runner.add_argument("--pause", type=float, default=2, help="seconds between the rates")
+    runner.add_argument("--json", action="store_true", help="print one JSON object per rate")
+
+    stand_in = commands.add_parser("peer", help="run a stand-in switch")
+    stand_in.add_argument("--address", default="127.0.0.1")
+    stand_in.add_argument("--port", type=int, default=8080)
+    stand_in.add_argument("--service-ms", type=float, default=3, help="service time of every request")
+
+    arguments = parser.parse_args()
+    if arguments.command == "run":
+        run(arguments)
+    else:
+        peer(arguments)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+"""Static RAM budget of the firmware, taken from the linker map.
+
+The ESP8266 builds link with -fdata-sections, so every global of the sketch
+lands in its own .data.<name>, .bss.<name> or .rodata.<name> section and the
+map file lists it with its real size. The symbols are grouped into modules by
+their names, everything that matches no module is counted as "other", so a
+new global can't slip past the budget. The script prints the report and exits
+with 1 when a module or the total is over its budget.
+
+    tools/ram_budget.py .pio/build/switch/firmware.map
+"""
+
+import argparse
+import re
+import sys
+from collections import defaultdict
+
+# Module, budget in bytes and the name patterns of its globals.
+MODULES = [
+    ("logging", 768, [r"^serial_", r"^log_"]),
+    ("tasks", 256, [r"^tasks?_", r"^tasks$", r"^outbound", r"^received_"]),
+    ("peers", 1536, [r"^sync_", r"^devices", r"^mdns_", r"^replies"]),
+    ("metrics", 2048, [r"_latency$", r"^relay_jitter$", r"^recent_hops", r"^boot_phases", r"^messages_", r"^stall"]),
+    ("admission", 192, [r"_buckets?$", r"^throttled", r"^overloaded"]),
+    ("arena", 1600, [r"^arena"]),
+    ("other", 2048, []),
+]
+TOTAL = 7168
+
+SECTION = re.compile(r"^ \.(data|bss|rodata)\.(\S+)(?:\s+(0x[0-9a-f]+)\s+(0x[0-9a-f]+)\s+(\S+))?$")
+PLACEMENT = re.compile(r"^\s+(0x[0-9a-f]+)\s+(0x[0-9a-f]+)\s+(\S+)$")
+
+
+def read_symbols(path, objects):
+    """Yields (name, size) of the globals placed by the sketch objects."""
+    pending = None
+    with open(path, errors="replace") as lines:
+        for line in lines:
+            line = line.rstrip("\n")
+            if pending:
+                match = PLACEMENT.match(line)
+                if match and int(match.group(2), 16) > 0 and objects.search(match.group(3)):
+                    yield pending, int(match.group(2), 16)
+                pending = None
+                continue
+            match = SECTION.match(line)
+            if not match:
+                continue
+            if match.group(3) is None:
+                pending = match.group(2)
+            elif int(match.group(4), 16) > 0 and objects.search(match.group(5)):
+                yield match.group(2), int(match.group(4), 16)
+
+
+def module_of(name):
+    for module, _, patterns in MODULES:
+        if any(re.search(pattern, name) for pattern in patterns):
+            return module
+    return "other"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("map", help="linker map of the firmware")
+    parser.add_argument("--objects", default=r"(^|/)src/[^/]+\.o$|main\.cpp\.o$",
+                        help="regular expression of the sketch object files")
+    parser.add_argument("--verbose", action="store_true", help="list the globals of every module")
+    args = parser.parse_args()
+
+    sizes = defaultdict(int)
+    symbols = defaultdict(list)
+    for name, size in read_symbols(args.map, re.compile(args.objects)):
+        module = module_of(name)
+        sizes[module] += size
+        symbols[module].append((size, name))
+
+    failed = False
+    for module, budget, _ in MODULES:
+        over = sizes[module] > budget
+        failed |= over
+        print(f"{module:<10} {sizes[module]:>6} / {budget:<6}{'  over budget' if over else ''}")
+        if args.verbose:
+            for size, name in sorted(symbols[module], reverse=True):
+                print(f"  {size:>6} {name}")
+    total = sum(sizes.values())
+    failed |= total > TOTAL
+    print(f"{'total':<10} {total:>6} / {TOTAL:<6}{'  over budget' if total > TOTAL else ''}")
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())